@@ -4,8 +4,100 @@
 #include <libconfig.h++>
 
 #include "../src/meshgenerator.h"
+#include "../src/tiledmeshgenerator.h"
+#include "../src/remeshgenerator.h"
 using namespace std;
 
+//------------------------------------------------------------------------------
+template<class T>
+mg::MeshStatistics writeMesh(mg::MeshGeneratorT<T> &mg, mg::Parameters param)
+{
+    mg::MeshStatistics stats;
+    if(param.fusedPostProcessing)
+    {
+        std::cout << "Post-processing" << std::endl;
+        stats = mg.postProcess(param.basePath + "/mesh");
+    }
+    else
+    {
+        if(param.replicate_x > 1 || param.replicate_y > 1)
+            mg.writeReplicated(param.basePath + "/mesh");
+        else
+            mg.save_image_and_xyz(param.basePath + "/mesh");
+        std::cout << "Calculating Radial Distribution" << std::endl;
+        mg.calculateRadialDistribution();
+    }
+    if(param.saveIterationCounts)
+        mg.getIterationCounts().save(param.basePath + "/iteration_counts.txt",
+                                     arma::raw_ascii);
+    if(param.saveBonds)
+    {
+        std::cout << "Writing bond lists" << std::endl;
+        double horizon = param.horizon;
+        if(horizon <= 0)
+            horizon = param.horizonFactor*mg.getOptimalGridSpacing();
+        mg.writeBondList(param.basePath + "/bonds.csr", horizon);
+    }
+    if(!param.fusedPostProcessing)
+    {
+        std::cout << "Writing configuration" << std::endl;
+        mg.writeConfiguration();
+        if(param.validatePrecision)
+            stats = mg.calculateStatistics();
+    }
+    if(param.reportLoadBalance)
+        mg.writeLoadBalance();
+
+    return stats;
+}
+//------------------------------------------------------------------------------
+template<class T>
+mg::MeshStatistics generateMesh(mg::Parameters param)
+{
+    mg::MeshGeneratorT<T> mg(param);
+    if(param.poissonDisk)
+        mg.initializePoissonDisk();
+    mg.createMesh();
+    std::cout << "Geometry created" << std::endl;
+    return writeMesh(mg, param);
+}
+//------------------------------------------------------------------------------
+void remeshMesh(mg::Parameters param)
+{
+    mg::RemeshGenerator remesher(param);
+    remesher.readPreviousMesh(param.previousMeshPath,
+                              param.previousIterationCountsPath,
+                              param.previousImgPath);
+    arma::mat x = remesher.remesh();
+    std::cout << "Geometry updated" << std::endl;
+
+    param.nParticles = x.n_cols;
+    mg::MeshGenerator mg(param, remesher.getMask());
+    mg.setGenerators(x, arma::mat(2, 0), remesher.getIterationCounts());
+
+    // Only the volumes around the changed regions were recomputed
+    arma::vec volumes = remesher.getVolumes();
+    if(!volumes.is_empty())
+        mg.setVolumes(volumes);
+    mg.createDomainGrid();
+    writeMesh(mg, param);
+}
+//------------------------------------------------------------------------------
+void expandSnapshots(mg::Parameters param)
+{
+    // Writing the debug output of each stored step, as without the stream
+    mg::SnapshotReader reader(param.expandSnapshots);
+    mg::MeshGenerator mg(param);
+    for(int frame=0; frame<reader.nFrames(); frame++)
+    {
+        int k = reader.iteration(frame);
+        std::cout << "Snapshot of iteration " << k << std::endl;
+        mg.setGenerators(reader.read(frame), arma::mat(2, 0));
+        mg.createDomainGrid();
+        mg.save_image_and_xyz(param.basePath + "/alg1", k);
+        mg.calculateRadialDistribution(k);
+    }
+}
 //------------------------------------------------------------------------------
 int main(int argc, char** argv)
 {
@@ -55,6 +147,24 @@ int main(int argc, char** argv)
     else
         std::cerr << "MultiplicationFactor not supplied" << std::endl;
 
+    if(root.exists("sampleSchedule"))
+        param.sampleSchedule = (const char *) root["sampleSchedule"];
+    if(root.exists("sampleStartFraction"))
+        param.sampleStartFraction = root["sampleStartFraction"];
+    if(root.exists("sampleGrowthIterations"))
+        param.sampleGrowthIterations = root["sampleGrowthIterations"];
+    if(root.exists("sampleNoiseTolerance"))
+        param.sampleNoiseTolerance = root["sampleNoiseTolerance"];
+    if(param.sampleSchedule != "constant" &&
+            param.sampleSchedule != "geometric" &&
+            param.sampleSchedule != "linear" &&
+            param.sampleSchedule != "adaptive")
+    {
+        std::cerr << "Unknown sampleSchedule " << param.sampleSchedule
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
     if(root.exists("savePath"))
     {
         param.basePath = (const char *) cfg.lookup("savePath");
@@ -77,8 +187,16 @@ int main(int argc, char** argv)
         param.periodic_x = (int) root["periodic_x"];
     if(root.exists("periodic_y"))
         param.periodic_y = (int) root["periodic_y"];
+    if(root.exists("ghostLayer"))
+        param.ghostLayer = (int) root["ghostLayer"];
     if(root.exists("saveImage"))
         param.saveImage = (int) root["saveImage"];
+    if(root.exists("fusedPostProcessing"))
+        param.fusedPostProcessing = (int) root["fusedPostProcessing"];
+    if(root.exists("saveMetrics"))
+        param.saveMetrics = (int) root["saveMetrics"];
+    if(root.exists("rasterBandRows"))
+        param.rasterBandRows = std::max(1, (int) root["rasterBandRows"]);
     if(root.exists("imageResolution"))
         param.imageResolution = (int) root["imageResolution"];
     if(root.exists("alpha_1"))
@@ -93,12 +211,139 @@ int main(int argc, char** argv)
         param.testingSave = root["debug"];
     if(root.exists("testSaveFreq"))
         param.testSaveFreq = root["testSaveFreq"];
+    if(root.exists("snapshotStream"))
+        param.snapshotStream = (int) root["snapshotStream"];
+    if(root.exists("snapshotKeyframes"))
+        param.snapshotKeyframes = root["snapshotKeyframes"];
+    if(root.exists("expandSnapshots"))
+        param.expandSnapshots = (const char *) root["expandSnapshots"];
     if(root.exists("redistributionFrequency"))
         param.redistributionFrequency = root["redistributionFrequency"];
     if(root.exists("nRedistributedPoints"))
         param.nRedistributedPoints = root["nRedistributedPoints"];
+    if(root.exists("targetedRedistribution"))
+        param.targetedRedistribution = (int) root["targetedRedistribution"];
+    if(root.exists("redistributionLow"))
+        param.redistributionLow = root["redistributionLow"];
+    if(root.exists("redistributionHigh"))
+        param.redistributionHigh = root["redistributionHigh"];
+    if(root.exists("andersonAcceleration"))
+        param.andersonAcceleration = (int) root["andersonAcceleration"];
+    if(root.exists("andersonDepth"))
+        param.andersonDepth = root["andersonDepth"];
+    if(root.exists("andersonStart"))
+        param.andersonStart = root["andersonStart"];
+    if(root.exists("andersonRegularization"))
+        param.andersonRegularization = root["andersonRegularization"];
+    if(root.exists("andersonRestartFactor"))
+        param.andersonRestartFactor = root["andersonRestartFactor"];
+    if(root.exists("andersonMaxStep"))
+        param.andersonMaxStep = root["andersonMaxStep"];
+    if(root.exists("convergenceTolerance"))
+        param.convergenceTolerance = root["convergenceTolerance"];
+    if(root.exists("saveConvergence"))
+        param.saveConvergence = (int) root["saveConvergence"];
     if(root.exists("openmp_threads"))
         param.openmp_threads = root["openmp_threads"];
+    if(root.exists("numaFirstTouch"))
+        param.numaFirstTouch = (int) root["numaFirstTouch"];
+    if(root.exists("replicateMask"))
+        param.replicateMask = (int) root["replicateMask"];
+    if(root.exists("threadAffinity"))
+        param.threadAffinity = (const char *) root["threadAffinity"];
+    if(!param.threadAffinity.empty() && param.threadAffinity != "close" &&
+            param.threadAffinity != "spread")
+    {
+        std::cerr << "Unknown threadAffinity " << param.threadAffinity
+                  << ", use close or spread" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+#ifdef MG_USE_TBB
+    // The replicas, the first touch and the pinning follow the OpenMP
+    // threads, while the TBB workers run the sampling on any core
+    if(param.numaFirstTouch || param.replicateMask ||
+            !param.threadAffinity.empty())
+    {
+        std::cerr << "numaFirstTouch, replicateMask and threadAffinity are "
+                  << "ignored in TBB builds" << std::endl;
+        param.numaFirstTouch = false;
+        param.replicateMask = false;
+        param.threadAffinity = "";
+    }
+#endif
+    if(root.exists("saveBonds"))
+        param.saveBonds = (int) root["saveBonds"];
+    if(root.exists("horizon"))
+        param.horizon = root["horizon"];
+    if(root.exists("horizonFactor"))
+        param.horizonFactor = root["horizonFactor"];
+    if(root.exists("saveBondLengths"))
+        param.saveBondLengths = (int) root["saveBondLengths"];
+    if(root.exists("singlePrecision"))
+        param.singlePrecision = (int) root["singlePrecision"];
+    if(root.exists("validatePrecision"))
+        param.validatePrecision = (int) root["validatePrecision"];
+    if(root.exists("cacheMask"))
+        param.cacheMask = (int) root["cacheMask"];
+    if(root.exists("adaptiveIndex"))
+        param.adaptiveIndex = (int) root["adaptiveIndex"];
+    if(root.exists("hilbertOrder"))
+        param.hilbertOrder = (int) root["hilbertOrder"];
+    if(root.exists("reorderFrequency"))
+        param.reorderFrequency = root["reorderFrequency"];
+    if(root.exists("poissonDisk"))
+        param.poissonDisk = (int) root["poissonDisk"];
+    if(root.exists("poissonRadius"))
+        param.poissonRadius = root["poissonRadius"];
+    if(root.exists("lloydIterations"))
+        param.lloydIterations = root["lloydIterations"];
+    if(root.exists("exactVolumes"))
+        param.exactVolumes = (int) root["exactVolumes"];
+    if(root.exists("sparseGrid"))
+        param.sparseGrid = (int) root["sparseGrid"];
+    if(root.exists("sampleBlockSize"))
+        param.sampleBlockSize = root["sampleBlockSize"];
+    if(root.exists("reportLoadBalance"))
+        param.reportLoadBalance = (int) root["reportLoadBalance"];
+    if(root.exists("tiled"))
+        param.tiled = (int) root["tiled"];
+    if(root.exists("tileSize"))
+        param.tileSize = root["tileSize"];
+    if(root.exists("tileHalo"))
+        param.tileHalo = root["tileHalo"];
+
+    if(root.exists("replicate_x"))
+        param.replicate_x = root["replicate_x"];
+    if(root.exists("replicate_y"))
+        param.replicate_y = root["replicate_y"];
+    if((param.replicate_x > 1 && !param.periodic_x) ||
+            (param.replicate_y > 1 && !param.periodic_y))
+    {
+        std::cerr << "Only periodic tiles can be replicated" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if(param.replicate_x < 1 || param.replicate_y < 1 ||
+            double(param.nParticles)*param.replicate_x*param.replicate_y
+            > INT32_MAX)
+    {
+        std::cerr << "Invalid replication, the copies must fit in 32 bit ids"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if(root.exists("remesh"))
+        param.remesh = (int) root["remesh"];
+    if(root.exists("previousImgPath"))
+        param.previousImgPath = (const char *) root["previousImgPath"];
+    if(root.exists("previousMeshPath"))
+        param.previousMeshPath = (const char *) root["previousMeshPath"];
+    if(root.exists("previousIterationCountsPath"))
+        param.previousIterationCountsPath =
+                (const char *) root["previousIterationCountsPath"];
+    if(root.exists("remeshBuffer"))
+        param.remeshBuffer = root["remeshBuffer"];
+    if(root.exists("saveIterationCounts"))
+        param.saveIterationCounts = (int) root["saveIterationCounts"];
 
 
     if(root.exists("X") && root.exists("Y"))
@@ -114,6 +359,8 @@ int main(int argc, char** argv)
 
 
     param.q = param.nParticles*param.q;
+    if(param.poissonDisk)
+        param.threshold = param.lloydIterations;
     //--------------------------------------------------------------------------
 
     boost::filesystem::path dir(param.basePath);
@@ -121,18 +368,54 @@ int main(int argc, char** argv)
         std::cout << "Directory created: " << param.basePath << "\n";
     }
 
+    if(!param.threadAffinity.empty())
+        mg::pinThreads(param.openmp_threads, param.threadAffinity);
+
     arma::wall_clock timer;
 
     timer.tic();
 
-    mg::MeshGenerator mg(param);
-    arma::mat x = mg.createMesh();
-    std::cout << "Geometry created" << std::endl;
-    mg.save_image_and_xyz(param.basePath + "/mesh");
-    std::cout << "Calculating Radial Distribution" << std::endl;
-    mg.calculateRadialDistribution();
-    std::cout << "Writing configuration" << std::endl;
-    mg.writeConfiguration();
+    if(param.tiled)
+    {
+        mg::TiledMeshGenerator tmg(param);
+        tmg.createMesh(param.basePath + "/mesh");
+        std::cout << "Geometry created" << std::endl;
+        tmg.writeConfiguration();
+
+        double n_secs = timer.toc();
+        std::cout << "Geometry computed in " << n_secs << " seconds" << std::endl;
+        std::cout << "Complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    if(!param.expandSnapshots.empty())
+    {
+        expandSnapshots(param);
+    }
+    else if(param.remesh)
+    {
+        remeshMesh(param);
+    }
+    else if(param.singlePrecision)
+    {
+        mg::MeshStatistics stats = generateMesh<float>(param);
+
+        if(param.validatePrecision)
+        {
+            // The double precision reference is written to a subdirectory.
+            std::cout << "Generating double precision reference" << std::endl;
+            mg::Parameters refParam = param;
+            refParam.basePath = param.basePath + "/double_reference";
+            boost::filesystem::create_directories(refParam.basePath);
+            mg::MeshStatistics reference = generateMesh<double>(refParam);
+            mg::compareStatistics(param.basePath + "/precision_validation.txt",
+                                  stats, reference);
+        }
+    }
+    else
+    {
+        generateMesh<double>(param);
+    }
 
     double n_secs = timer.toc();
 
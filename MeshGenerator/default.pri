@@ -3,6 +3,7 @@ INCLUDEPATH += $$SRC_DIR
 LIBS += -larmadillo
 LIBS += -lboost_system -lboost_filesystem
 LIBS += -ltiff -lpng -lX11
+LIBS += -lz
 
 CONFIG *= c++11
 QMAKE_RPATHDIR += $$TOP_OUT_PWD/src
@@ -13,6 +14,12 @@ QMAKE_CXXFLAGS += $$COMMON_CXXFLAGS
 LIBS += -fopenmp
 QMAKE_CXX += -fopenmp
 
+# Work-stealing TBB scheduling for the parallel loops, build with CONFIG+=tbb
+tbb {
+    DEFINES += MG_USE_TBB
+    LIBS += -ltbb
+}
+
 release {
     # Remoing other O flags
     QMAKE_CXXFLAGS_RELEASE -= -O
@@ -0,0 +1,107 @@
+#include "andersonmixing.h"
+
+//------------------------------------------------------------------------------
+mg::AndersonMixing::AndersonMixing(int depth, double regularization,
+                                   double restartFactor):
+    depth(depth),
+    regularization(regularization),
+    restartFactor(restartFactor)
+{
+}
+//------------------------------------------------------------------------------
+arma::vec mg::AndersonMixing::mix(const arma::vec &x, const arma::vec &g)
+{
+    accelerated = false;
+    arma::vec f = g - x;
+    minimumImage(f);
+
+    if(hasPrevious)
+    {
+        arma::vec df = f - f_prev;
+        arma::vec dg = g - g_prev;
+        minimumImage(df);
+        minimumImage(dg);
+        dF.push_back(df);
+        dG.push_back(dg);
+        if((int)dF.size() > depth)
+        {
+            dF.pop_front();
+            dG.pop_front();
+        }
+    }
+    f_prev = f;
+    g_prev = g;
+    hasPrevious = true;
+
+    // A growing residual means the history no longer describes the map.
+    double residual = arma::norm(f);
+    if(previousResidual > 0 && residual > restartFactor*previousResidual)
+    {
+        dF.clear();
+        dG.clear();
+    }
+    previousResidual = residual;
+
+    int m = dF.size();
+    if(m == 0)
+        return g;
+
+    // Regularised normal equations of min |f - dF gamma|
+    arma::mat A(m, m);
+    arma::vec b(m);
+    for(int i=0; i<m; i++)
+    {
+        for(int j=0; j<=i; j++)
+        {
+            A(i, j) = arma::dot(dF[i], dF[j]);
+            A(j, i) = A(i, j);
+        }
+        b(i) = arma::dot(dF[i], f);
+    }
+    double scale = arma::trace(A)/m;
+    if(scale <= 0)
+        return g;
+    A.diag() += regularization*scale;
+
+    arma::vec gamma;
+    if(!arma::solve(gamma, A, b))
+    {
+        restart();
+        return g;
+    }
+
+    arma::vec x_next = g;
+    for(int i=0; i<m; i++)
+        x_next -= gamma(i)*dG[i];
+
+    accelerated = true;
+    return x_next;
+}
+//------------------------------------------------------------------------------
+void mg::AndersonMixing::restart()
+{
+    dF.clear();
+    dG.clear();
+    hasPrevious = false;
+    previousResidual = 0;
+}
+//------------------------------------------------------------------------------
+bool mg::AndersonMixing::lastStepAccelerated() const
+{
+    return accelerated;
+}
+//------------------------------------------------------------------------------
+void mg::AndersonMixing::setPeriods(const arma::vec &periods)
+{
+    this->periods = periods;
+}
+//------------------------------------------------------------------------------
+void mg::AndersonMixing::minimumImage(arma::vec &d) const
+{
+    if(periods.n_elem != d.n_elem)
+        return;
+    for(arma::uword k=0; k<d.n_elem; k++)
+        if(periods(k) > 0)
+            d(k) -= periods(k)*round(d(k)/periods(k));
+}
+//------------------------------------------------------------------------------
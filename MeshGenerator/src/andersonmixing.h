@@ -0,0 +1,56 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * Anderson mixing for a fixed-point iteration x = g(x). The last few
+ * residuals f = g(x) - x are combined to extrapolate the next iterate. The
+ * history is cleared whenever the residual grows, which keeps the noise in
+ * Monte Carlo estimates of g from being amplified.
+ */
+
+#ifndef ANDERSONMIXING_H
+#define ANDERSONMIXING_H
+
+#include <armadillo>
+#include <deque>
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+class AndersonMixing
+{
+public:
+    AndersonMixing(int depth, double regularization, double restartFactor);
+
+    // Returns the next iterate given the current iterate x and g(x).
+    arma::vec mix(const arma::vec &x, const arma::vec &g);
+    void restart();
+    bool lastStepAccelerated() const;
+
+    // Period of each component, zero for non-periodic components. The
+    // differences are taken as the minimum image, so that an iterate
+    // wrapped across a periodic edge does not enter the history as a jump.
+    void setPeriods(const arma::vec &periods);
+protected:
+    int depth;
+    double regularization;
+    double restartFactor;
+
+    std::deque<arma::vec> dF;
+    std::deque<arma::vec> dG;
+    arma::vec f_prev;
+    arma::vec g_prev;
+    bool hasPrevious = false;
+    double previousResidual = 0;
+    bool accelerated = false;
+    arma::vec periods;
+
+    void minimumImage(arma::vec &d) const;
+};
+//------------------------------------------------------------------------------
+}
+#endif // ANDERSONMIXING_H
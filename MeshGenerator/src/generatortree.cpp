@@ -0,0 +1,199 @@
+#include "generatortree.h"
+
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+template<class T>
+void mg::GeneratorTreeT<T>::build(const arma::Mat<T> &x, int nPoints,
+                                  bool wrap_x, bool wrap_y,
+                                  T X_0, T X_1, T Y_0, T Y_1)
+{
+    this->wrap_x = wrap_x;
+    this->wrap_y = wrap_y;
+    this->X_0 = X_0;
+    this->X_1 = X_1;
+    this->Y_0 = Y_0;
+    this->Y_1 = Y_1;
+
+    nodes.clear();
+    ids.resize(nPoints);
+    px.resize(nPoints);
+    py.resize(nPoints);
+    if(nPoints == 0)
+        return;
+    nodes.resize(subtreeNodes(nPoints));
+
+    T x0 = numeric_limits<T>::max();
+    T x1 = -numeric_limits<T>::max();
+    T y0 = numeric_limits<T>::max();
+    T y1 = -numeric_limits<T>::max();
+#pragma omp parallel for reduction(min:x0, y0) reduction(max:x1, y1)
+    for(int i=0; i<nPoints; i++)
+    {
+        ids[i] = i;
+        px[i] = x(0, i);
+        py[i] = x(1, i);
+        x0 = std::min(x0, px[i]);
+        x1 = std::max(x1, px[i]);
+        y0 = std::min(y0, py[i]);
+        y1 = std::max(y1, py[i]);
+    }
+
+#pragma omp parallel
+#pragma omp single
+    buildNode(0, 0, nPoints, x0, x1, y0, y1);
+
+    // Storing the positions in tree order, so that the leaves are contiguous
+#pragma omp parallel for
+    for(int k=0; k<nPoints; k++)
+    {
+        px[k] = x(0, ids[k]);
+        py[k] = x(1, ids[k]);
+    }
+}
+//------------------------------------------------------------------------------
+template<class T>
+int mg::GeneratorTreeT<T>::subtreeNodes(int nPoints)
+{
+    if(nPoints <= leafSize)
+        return 1;
+    int half = nPoints/2;
+    return 1 + subtreeNodes(half) + subtreeNodes(nPoints - half);
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::GeneratorTreeT<T>::buildNode(int id, int begin, int end,
+                                      T x0, T x1, T y0, T y1)
+{
+    Node node;
+    node.begin = begin;
+    node.end = end;
+    node.left = -1;
+    node.right = -1;
+    node.split = 0;
+    node.axis = -1;
+
+    if(end - begin <= leafSize)
+    {
+        nodes[id] = node;
+        return;
+    }
+
+    // Splitting the longest side at the median. The left subtree follows
+    // the node, the right subtree the left one.
+    node.axis = (x1 - x0 >= y1 - y0) ? 0 : 1;
+    const std::vector<T> &p = node.axis == 0 ? px : py;
+    int mid = (begin + end)/2;
+    std::nth_element(ids.begin() + begin, ids.begin() + mid,
+                     ids.begin() + end,
+                     [&](int a, int b) { return p[a] < p[b]; });
+    node.split = p[ids[mid]];
+    node.left = id + 1;
+    node.right = id + 1 + subtreeNodes(mid - begin);
+    nodes[id] = node;
+
+    T lx1 = node.axis == 0 ? node.split : x1;
+    T ly1 = node.axis == 0 ? y1 : node.split;
+    T rx0 = node.axis == 0 ? node.split : x0;
+    T ry0 = node.axis == 0 ? y0 : node.split;
+
+#pragma omp task if(end - begin > taskSize)
+    buildNode(node.left, begin, mid, x0, lx1, y0, ly1);
+    buildNode(node.right, mid, end, rx0, x1, ry0, y1);
+#pragma omp taskwait
+}
+//------------------------------------------------------------------------------
+template<class T>
+int mg::GeneratorTreeT<T>::nearest(const T y[2], T y_image[2]) const
+{
+    int best = -1;
+    T bestDistance = numeric_limits<T>::max();
+    y_image[0] = y[0];
+    y_image[1] = y[1];
+    if(nodes.empty())
+        return best;
+
+    search(y[0], y[1], best, bestDistance);
+
+    if(!wrap_x && !wrap_y)
+        return best;
+
+    // Periodic images are only searched when the closest generator found so
+    // far is further away than the boundary.
+    T DX = X_1 - X_0;
+    T DY = Y_1 - Y_0;
+    for(int i=-1; i<=1; i++)
+    {
+        if(i != 0 && !wrap_x)
+            continue;
+        for(int j=-1; j<=1; j++)
+        {
+            if((j != 0 && !wrap_y) || (i == 0 && j == 0))
+                continue;
+
+            T y_0 = y[0] + i*DX;
+            T y_1 = y[1] + j*DY;
+
+            T d_0 = std::max(std::max(X_0 - y_0, y_0 - X_1), T(0));
+            T d_1 = std::max(std::max(Y_0 - y_1, y_1 - Y_1), T(0));
+            if(d_0*d_0 + d_1*d_1 >= bestDistance)
+                continue;
+
+            T previousDistance = bestDistance;
+            search(y_0, y_1, best, bestDistance);
+            if(bestDistance < previousDistance)
+            {
+                y_image[0] = y_0;
+                y_image[1] = y_1;
+            }
+        }
+    }
+
+    return best;
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::GeneratorTreeT<T>::search(T y_0, T y_1,
+                                   int &best, T &bestDistance) const
+{
+    // Nodes waiting to be searched, with a lower bound of their distance
+    std::pair<int, T> stack[128];
+    int top = 0;
+    stack[top++] = std::make_pair(0, T(0));
+
+    while(top > 0)
+    {
+        std::pair<int, T> entry = stack[--top];
+        if(entry.second >= bestDistance)
+            continue;
+        const Node &node = nodes[entry.first];
+
+        if(node.axis < 0)
+        {
+            for(int k=node.begin; k<node.end; k++)
+            {
+                T d_0 = y_0 - px[k];
+                T d_1 = y_1 - py[k];
+                T distance = d_0*d_0 + d_1*d_1;
+                if(distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    best = ids[k];
+                }
+            }
+            continue;
+        }
+
+        // The far side is pushed first, so that the near side is searched
+        // first and shrinks the distance used to prune the far side.
+        T d = (node.axis == 0 ? y_0 : y_1) - node.split;
+        int nearChild = d < 0 ? node.left : node.right;
+        int farChild = d < 0 ? node.right : node.left;
+
+        stack[top++] = std::make_pair(farChild, std::max(entry.second, d*d));
+        stack[top++] = std::make_pair(nearChild, entry.second);
+    }
+}
+//------------------------------------------------------------------------------
+template class mg::GeneratorTreeT<double>;
+template class mg::GeneratorTreeT<float>;
@@ -0,0 +1,73 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * A k-d tree over the generator positions for exact nearest generator
+ * queries. The tree is split at the median along the longest side of each
+ * node, so the leaves follow the actual generator density instead of the
+ * mean density of the domain. The nodes are stored in depth-first order at
+ * positions known from the point counts alone, so the subtrees are built in
+ * parallel. Periodic images are searched only when the
+ * current best distance reaches over the boundary.
+ */
+
+#ifndef GENERATORTREE_H
+#define GENERATORTREE_H
+
+#include <armadillo>
+#include <vector>
+#include <limits>
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+template<class T>
+class GeneratorTreeT
+{
+public:
+    // Builds the tree over the first nPoints columns of x.
+    void build(const arma::Mat<T> &x, int nPoints, bool wrap_x, bool wrap_y,
+               T X_0, T X_1, T Y_0, T Y_1);
+
+    // Returns the column of the generator closest to y, or -1 for an empty
+    // tree. y_image is set to the periodic image of y closest to it.
+    int nearest(const T y[2], T y_image[2]) const;
+protected:
+    struct Node
+    {
+        T split;
+        int axis;       // -1 for leaves
+        int left;
+        int right;
+        int begin;
+        int end;
+    };
+
+    static const int leafSize = 8;
+    // Subtrees with more points are built as separate tasks
+    static const int taskSize = 16384;
+
+    std::vector<Node> nodes;
+    std::vector<int> ids;
+    std::vector<T> px;
+    std::vector<T> py;
+
+    bool wrap_x = false;
+    bool wrap_y = false;
+    T X_0, X_1, Y_0, Y_1;
+
+    static int subtreeNodes(int nPoints);
+    void buildNode(int id, int begin, int end, T x0, T x1, T y0, T y1);
+    void search(T y_0, T y_1, int &best, T &bestDistance) const;
+};
+//------------------------------------------------------------------------------
+typedef GeneratorTreeT<double> GeneratorTree;
+//------------------------------------------------------------------------------
+}
+#endif // GENERATORTREE_H
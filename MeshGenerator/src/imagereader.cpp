@@ -0,0 +1,674 @@
+#include "imagereader.h"
+
+#include <tiffio.h>
+#include <png.h>
+#include <CImg.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+
+using namespace cimg_library;
+
+//------------------------------------------------------------------------------
+// Mask cache file layout: the header followed by w*h bytes, row by row.
+//------------------------------------------------------------------------------
+struct MaskCacheHeader
+{
+    char magic[8];
+    uint64_t fingerprint;
+    uint32_t width;
+    uint32_t height;
+    uint64_t reserved;
+};
+static const char maskCacheMagic[8] = {'M', 'G', 'M', 'A', 'S', 'K', '0', '1'};
+
+//------------------------------------------------------------------------------
+static uint64_t fnv1a(const unsigned char *data, size_t size, uint64_t hash)
+{
+    for(size_t i=0; i<size; i++)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+//------------------------------------------------------------------------------
+mg::ImageReader::ImageReader(string path, bool useCache):
+    path(path),
+    useCache(useCache)
+{
+    cachePath = path + ".mgmask";
+
+    if(useCache)
+    {
+        fingerprint = computeFingerprint();
+        if(mapCache())
+        {
+            std::cout << "Using cached mask " << cachePath << std::endl;
+            return;
+        }
+    }
+
+    string extension = boost::filesystem::path(path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   ::tolower);
+
+    if(extension == ".tif" || extension == ".tiff")
+        openTiff();
+    else if(extension == ".png")
+        openPng();
+
+    if(!tif && !png)
+    {
+        CImg<double> image(path.c_str());
+        h = image.height();
+        w = image.width();
+        decoded = arma::uchar_mat(h, w);
+        for(int j=0;j<w;j++) {
+            for(int i=0;i<h;i++) {
+                decoded(i,j) = image(j,i,0,0) > 0;
+            }
+        }
+    }
+}
+//------------------------------------------------------------------------------
+mg::ImageReader::~ImageReader()
+{
+    if(tif)
+        TIFFClose(tif);
+    if(mapping)
+        munmap(mapping, mappingSize);
+}
+//------------------------------------------------------------------------------
+int mg::ImageReader::width() const
+{
+    return w;
+}
+//------------------------------------------------------------------------------
+int mg::ImageReader::height() const
+{
+    return h;
+}
+//------------------------------------------------------------------------------
+arma::uchar_mat mg::ImageReader::readMask()
+{
+    arma::uchar_mat mask(h, w);
+
+    if(cache)
+    {
+        // Transposing the cached rows in blocks of columns
+        int blockSize = 64;
+#pragma omp parallel for
+        for(int jb=0; jb<w; jb+=blockSize)
+        {
+            int j_1 = std::min(jb + blockSize, w);
+            for(int i=0; i<h; i++)
+            {
+                const unsigned char *row = cache + (size_t)i*w;
+                for(int j=jb; j<j_1; j++)
+                    mask(i, j) = row[j];
+            }
+        }
+        return mask;
+    }
+
+    if(tif)
+    {
+        decodeTiff(mask);
+    }
+    else if(decoded.n_elem > 0)
+    {
+        mask = decoded;
+    }
+    else
+    {
+        decodePng([&](int i, const unsigned char *solid) {
+            for(int j=0; j<w; j++)
+                mask(i, j) = solid[j];
+        });
+    }
+
+    if(useCache)
+        writeCache(mask);
+
+    return mask;
+}
+//------------------------------------------------------------------------------
+arma::uchar_mat mg::ImageReader::readRegion(int x0, int y0, int w_r, int h_r)
+{
+    arma::uchar_mat region(h_r, w_r);
+
+    if(cache)
+    {
+        for(int i=0; i<h_r; i++)
+        {
+            const unsigned char *row = cache + (size_t)(y0 + i)*w + x0;
+            for(int j=0; j<w_r; j++)
+                region(i, j) = row[j];
+        }
+        return region;
+    }
+
+    if(tif)
+    {
+        readTiffRegion(region, x0, y0);
+        return region;
+    }
+
+    if(decoded.n_elem == 0)
+    {
+        std::cout << "Reading " << path << " into memory, out-of-core "
+                  << "reading of PNG images requires the mask cache"
+                  << std::endl;
+        decoded = arma::uchar_mat(h, w);
+        decodePng([&](int i, const unsigned char *solid) {
+            for(int j=0; j<w; j++)
+                decoded(i, j) = solid[j];
+        });
+    }
+
+    for(int j=0;j<w_r;j++) {
+        for(int i=0;i<h_r;i++) {
+            region(i,j) = decoded(y0 + i, x0 + j);
+        }
+    }
+    return region;
+}
+//------------------------------------------------------------------------------
+void mg::ImageReader::createCache()
+{
+    if(cache || !useCache)
+        return;
+
+    string tmpPath = cachePath + ".tmp";
+    ofstream outStream;
+    if(!openCache(outStream, tmpPath))
+        return;
+
+    decodeRows([&](int, const unsigned char *solid) {
+        outStream.write((const char*) solid, w);
+    });
+    outStream.close();
+
+    boost::filesystem::rename(tmpPath, cachePath);
+    mapCache();
+}
+//------------------------------------------------------------------------------
+uint64_t mg::ImageReader::computeFingerprint() const
+{
+    // Hashing the whole file, so that any change of the content invalidates
+    // the cache, whatever the modification time. The file is mapped and
+    // hashed in chunks in parallel, followed by the hashes of the chunks.
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return 0;
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+    uint64_t size = st.st_size;
+
+    uint64_t hash = 14695981039346656037ULL;
+    hash = fnv1a((const unsigned char*) &size, sizeof(size), hash);
+    if(size == 0)
+    {
+        close(fd);
+        return hash;
+    }
+
+    void *m = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED)
+        return 0;
+    madvise(m, size, MADV_SEQUENTIAL);
+
+    const unsigned char *data = (const unsigned char*) m;
+    const uint64_t chunkSize = 1 << 24;
+    long nChunks = (size + chunkSize - 1)/chunkSize;
+    std::vector<uint64_t> chunkHashes(nChunks);
+
+#pragma omp parallel for schedule(dynamic)
+    for(long c=0; c<nChunks; c++)
+    {
+        uint64_t begin = c*chunkSize;
+        uint64_t end = std::min(size, begin + chunkSize);
+        chunkHashes[c] = fnv1a(data + begin, end - begin,
+                               14695981039346656037ULL);
+    }
+    munmap(m, size);
+
+    return fnv1a((const unsigned char*) chunkHashes.data(),
+                 chunkHashes.size()*sizeof(uint64_t), hash);
+}
+//------------------------------------------------------------------------------
+bool mg::ImageReader::mapCache()
+{
+    int fd = open(cachePath.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MaskCacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED)
+        return false;
+
+    const MaskCacheHeader *header = (const MaskCacheHeader*) m;
+    size_t expectedSize = sizeof(MaskCacheHeader)
+            + (size_t)header->width*header->height;
+    if(memcmp(header->magic, maskCacheMagic, sizeof(maskCacheMagic)) != 0 ||
+            header->fingerprint != fingerprint ||
+            (size_t)st.st_size != expectedSize)
+    {
+        munmap(m, st.st_size);
+        return false;
+    }
+
+    if(mapping)
+        munmap(mapping, mappingSize);
+    mapping = m;
+    mappingSize = st.st_size;
+    w = header->width;
+    h = header->height;
+    cache = (const unsigned char*) m + sizeof(MaskCacheHeader);
+    madvise(mapping, mappingSize, MADV_WILLNEED);
+
+    return true;
+}
+//------------------------------------------------------------------------------
+bool mg::ImageReader::openCache(ofstream &outStream, string tmpPath)
+{
+    outStream.open(tmpPath.c_str(), ios::binary);
+    if(!outStream)
+    {
+        std::cerr << "Unable to write the mask cache " << cachePath
+                  << std::endl;
+        return false;
+    }
+
+    MaskCacheHeader header;
+    memcpy(header.magic, maskCacheMagic, sizeof(header.magic));
+    header.fingerprint = fingerprint;
+    header.width = w;
+    header.height = h;
+    header.reserved = 0;
+    outStream.write((const char*) &header, sizeof(header));
+
+    return true;
+}
+//------------------------------------------------------------------------------
+void mg::ImageReader::writeCache(const arma::uchar_mat &mask)
+{
+    string tmpPath = cachePath + ".tmp";
+    ofstream outStream;
+    if(!openCache(outStream, tmpPath))
+        return;
+
+    std::vector<unsigned char> row(w);
+    for(int i=0; i<h; i++)
+    {
+        for(int j=0; j<w; j++)
+            row[j] = mask(i, j);
+        outStream.write((const char*) row.data(), w);
+    }
+    outStream.close();
+
+    boost::filesystem::rename(tmpPath, cachePath);
+}
+//------------------------------------------------------------------------------
+void mg::ImageReader::openTiff()
+{
+    tif = TIFFOpen(path.c_str(), "r");
+    if(!tif)
+        return;
+
+    uint32_t width, height;
+    uint16_t bps, spp, planar, photometric;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+    if(!TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric))
+        photometric = PHOTOMETRIC_MINISBLACK;
+    minIsWhite = photometric == PHOTOMETRIC_MINISWHITE;
+    w = width;
+    h = height;
+    bitsPerSample = bps;
+    // Only the first channel is used, as when reading with CImg.
+    pixelStride = (planar == PLANARCONFIG_CONTIG) ? spp : 1;
+
+    if(bitsPerSample != 1 && bitsPerSample != 8 && bitsPerSample != 16)
+    {
+        std::cerr << "Unsupported TIFF bit depth " << bitsPerSample
+                  << " in " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    tiled = TIFFIsTiled(tif);
+    if(tiled)
+    {
+        uint32_t tw, th;
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+        tileWidth = tw;
+        tileHeight = th;
+        buffer.resize(TIFFTileSize(tif));
+    }
+    else
+    {
+        buffer.resize(TIFFScanlineSize(tif));
+    }
+}
+//------------------------------------------------------------------------------
+void mg::ImageReader::openPng()
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(!fp)
+        return;
+
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                                 nullptr, nullptr, nullptr);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if(setjmp(png_jmpbuf(png_ptr)))
+    {
+        png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+        fclose(fp);
+        return;
+    }
+    png_init_io(png_ptr, fp);
+    png_read_info(png_ptr, info_ptr);
+
+    w = png_get_image_width(png_ptr, info_ptr);
+    h = png_get_image_height(png_ptr, info_ptr);
+
+    // Interlaced images can not be decoded row by row and are left to CImg.
+    png = png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_NONE;
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+    fclose(fp);
+}
+//------------------------------------------------------------------------------
+void mg::ImageReader::decodeTiff(arma::uchar_mat &mask)
+{
+    // Each thread decodes whole strips or tiles through its own handle.
+    if(!tiled)
+    {
+        uint32_t rowsPerStrip;
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+        int rps = std::min<uint32_t>(rowsPerStrip, h);
+        int nStrips = (h + rps - 1)/rps;
+
+        bool failed = false;
+        bool corrupt = false;
+#pragma omp parallel
+        {
+            TIFF *t = TIFFOpen(path.c_str(), "r");
+            std::vector<unsigned char> strip(t ? TIFFStripSize(t) : 0);
+            int rowBytes = t ? TIFFScanlineSize(t) : 0;
+
+#pragma omp for schedule(dynamic)
+            for(int s=0; s<nStrips; s++)
+            {
+                if(!t)
+                {
+#pragma omp atomic write
+                    failed = true;
+                    continue;
+                }
+                if(TIFFReadEncodedStrip(t, s, strip.data(), -1) < 0)
+                {
+#pragma omp atomic write
+                    corrupt = true;
+                    continue;
+                }
+                int i_1 = std::min(h, (s + 1)*rps);
+                for(int i=s*rps; i<i_1; i++)
+                {
+                    const unsigned char *row = strip.data()
+                            + (size_t)(i - s*rps)*rowBytes;
+                    for(int j=0; j<w; j++)
+                        mask(i, j) = pixelSolid(row, j);
+                }
+            }
+            if(t)
+                TIFFClose(t);
+        }
+        if(failed)
+        {
+            std::cerr << "Unable to reopen " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if(corrupt)
+        {
+            std::cerr << "Unable to decode " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    int ntx = (w + tileWidth - 1)/tileWidth;
+    int nty = (h + tileHeight - 1)/tileHeight;
+    int rowBytes = buffer.size()/tileHeight;
+
+    bool failed = false;
+    bool corrupt = false;
+#pragma omp parallel
+    {
+        TIFF *t = TIFFOpen(path.c_str(), "r");
+        std::vector<unsigned char> tile(t ? TIFFTileSize(t) : 0);
+
+#pragma omp for schedule(dynamic)
+        for(int k=0; k<ntx*nty; k++)
+        {
+            if(!t)
+            {
+#pragma omp atomic write
+                failed = true;
+                continue;
+            }
+            int tx = (k % ntx)*tileWidth;
+            int ty = (k / ntx)*tileHeight;
+            if(TIFFReadEncodedTile(t, TIFFComputeTile(t, tx, ty, 0, 0),
+                                   tile.data(), -1) < 0)
+            {
+#pragma omp atomic write
+                corrupt = true;
+                continue;
+            }
+
+            int i_1 = std::min(ty + tileHeight, h);
+            int j_1 = std::min(tx + tileWidth, w);
+            for(int i=ty; i<i_1; i++)
+            {
+                const unsigned char *row = tile.data() + (size_t)(i - ty)*rowBytes;
+                for(int j=tx; j<j_1; j++)
+                    mask(i, j) = pixelSolid(row, j - tx);
+            }
+        }
+        if(t)
+            TIFFClose(t);
+    }
+    if(failed)
+    {
+        std::cerr << "Unable to reopen " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if(corrupt)
+    {
+        std::cerr << "Unable to decode " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+//------------------------------------------------------------------------------
+void mg::ImageReader::decodePng(
+        std::function<void(int, const unsigned char*)> processRow)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(!fp)
+    {
+        std::cerr << "Unable to open " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<unsigned char> row;
+    std::vector<unsigned char> solid(w);
+
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                                 nullptr, nullptr, nullptr);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if(setjmp(png_jmpbuf(png_ptr)))
+    {
+        std::cerr << "Error while decoding " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    png_init_io(png_ptr, fp);
+    png_read_info(png_ptr, info_ptr);
+
+    // Expanding to 8 or 16 bit samples, the first channel is used as with
+    // CImg. 16 bit samples are kept, so that values below 256 still count
+    // as solid, as in the 16 bit TIFF path.
+    if(png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png_ptr);
+    if(png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_GRAY &&
+            png_get_bit_depth(png_ptr, info_ptr) < 8)
+        png_set_expand_gray_1_2_4_to_8(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    int channels = png_get_channels(png_ptr, info_ptr);
+    int sampleBytes = png_get_bit_depth(png_ptr, info_ptr) == 16 ? 2 : 1;
+    row.resize(png_get_rowbytes(png_ptr, info_ptr));
+
+    for(int i=0; i<h; i++)
+    {
+        png_read_row(png_ptr, row.data(), nullptr);
+        for(int j=0; j<w; j++)
+        {
+            const unsigned char *sample = row.data() + j*channels*sampleBytes;
+            solid[j] = sample[0] > 0 || (sampleBytes == 2 && sample[1] > 0);
+        }
+        processRow(i, solid.data());
+    }
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+    fclose(fp);
+}
+//------------------------------------------------------------------------------
+void mg::ImageReader::decodeRows(
+        std::function<void(int, const unsigned char*)> processRow)
+{
+    if(png)
+    {
+        decodePng(processRow);
+        return;
+    }
+
+    std::vector<unsigned char> solid(w);
+
+    if(!tif)
+    {
+        for(int i=0; i<h; i++)
+        {
+            for(int j=0; j<w; j++)
+                solid[j] = decoded(i, j);
+            processRow(i, solid.data());
+        }
+        return;
+    }
+
+    // Decoding bands of one tile row at a time
+    int bandHeight = tiled ? tileHeight : 256;
+    for(int y0=0; y0<h; y0+=bandHeight)
+    {
+        arma::uchar_mat band(std::min(bandHeight, h - y0), w);
+        readTiffRegion(band, 0, y0);
+        for(int i=0; i<(int)band.n_rows; i++)
+        {
+            for(int j=0; j<w; j++)
+                solid[j] = band(i, j);
+            processRow(y0 + i, solid.data());
+        }
+    }
+}
+//------------------------------------------------------------------------------
+void mg::ImageReader::readTiffRegion(arma::uchar_mat &region, int x0, int y0)
+{
+    int w_r = region.n_cols;
+    int h_r = region.n_rows;
+
+    if(!tiled)
+    {
+        // libtiff has to restart a compressed strip when a scanline before
+        // the current one is requested, so regions are read row by row in
+        // increasing order.
+        for(int i=0; i<h_r; i++)
+        {
+            if(TIFFReadScanline(tif, buffer.data(), y0 + i, 0) < 0)
+            {
+                std::cerr << "Unable to decode " << path << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            for(int j=0; j<w_r; j++)
+                region(i, j) = pixelSolid(buffer.data(), x0 + j);
+        }
+        return;
+    }
+
+    // Reading every tile overlapping the region once
+    int rowBytes = buffer.size()/tileHeight;
+    for(int ty=(y0/tileHeight)*tileHeight; ty<y0 + h_r; ty+=tileHeight)
+    {
+        for(int tx=(x0/tileWidth)*tileWidth; tx<x0 + w_r; tx+=tileWidth)
+        {
+            if(TIFFReadTile(tif, buffer.data(), tx, ty, 0, 0) < 0)
+            {
+                std::cerr << "Unable to decode " << path << std::endl;
+                exit(EXIT_FAILURE);
+            }
+
+            int i_0 = std::max(ty, y0);
+            int i_1 = std::min(ty + tileHeight, y0 + h_r);
+            int j_0 = std::max(tx, x0);
+            int j_1 = std::min(tx + tileWidth, x0 + w_r);
+            for(int i=i_0; i<i_1; i++)
+            {
+                const unsigned char *row = buffer.data() + (i - ty)*rowBytes;
+                for(int j=j_0; j<j_1; j++)
+                    region(i - y0, j - x0) = pixelSolid(row, j - tx);
+            }
+        }
+    }
+}
+//------------------------------------------------------------------------------
+unsigned char mg::ImageReader::pixelSolid(const unsigned char *row, int i) const
+{
+    switch(bitsPerSample)
+    {
+    // Pixels are solid unless black. In min-is-white images black is stored
+    // as the largest value.
+    case 1:
+        return ((row[i/8] >> (7 - i%8)) & 1) != minIsWhite;
+    case 16:
+        if(minIsWhite)
+            return ((const uint16_t*) row)[i*pixelStride] < 0xffff;
+        return ((const uint16_t*) row)[i*pixelStride] > 0;
+    default:
+        if(minIsWhite)
+            return row[i*pixelStride] < 0xff;
+        return row[i*pixelStride] > 0;
+    }
+}
+//------------------------------------------------------------------------------
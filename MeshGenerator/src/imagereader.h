@@ -0,0 +1,95 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * The ImageReader class decodes a binary image straight into a mask where
+ * solid pixels are 1 and pore pixels are 0. TIFF images are decoded with
+ * libtiff, in parallel over strips or tiles, PNG images with libpng and other
+ * formats with CImg. The mask is cached next to the image in a memory mapped
+ * file, which is reused as long as the image is unchanged. Rectangular
+ * regions can be read without holding the full mask in memory.
+ */
+
+#ifndef IMAGEREADER_H
+#define IMAGEREADER_H
+
+#include <armadillo>
+#include <string>
+#include <vector>
+#include <functional>
+#include <fstream>
+#include <stdint.h>
+
+using namespace std;
+
+struct tiff;
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+class ImageReader
+{
+public:
+    ImageReader(string path, bool useCache = true);
+    ~ImageReader();
+
+    int width() const;
+    int height() const;
+
+    // The mask has the same layout as img_data in MeshGenerator, i.e.
+    // (row, column).
+    arma::uchar_mat readMask();
+    arma::uchar_mat readRegion(int x0, int y0, int w, int h);
+
+    // Decodes the image row by row into the mask cache and maps it, so that
+    // the full mask is never held in memory.
+    void createCache();
+protected:
+    string path;
+    string cachePath;
+    bool useCache;
+    int w = 0;
+    int h = 0;
+
+    // Memory mapped mask cache, stored row by row after the header
+    uint64_t fingerprint = 0;
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    const unsigned char *cache = nullptr;
+
+    // libtiff
+    tiff *tif = nullptr;
+    bool tiled = false;
+    int bitsPerSample = 8;
+    bool minIsWhite = false;
+    int pixelStride = 1;
+    int tileWidth = 0;
+    int tileHeight = 0;
+    std::vector<unsigned char> buffer;
+
+    // libpng
+    bool png = false;
+
+    // Fully decoded mask for formats that can not be read by region
+    arma::uchar_mat decoded;
+
+    uint64_t computeFingerprint() const;
+    bool mapCache();
+    bool openCache(ofstream &outStream, string tmpPath);
+    void writeCache(const arma::uchar_mat &mask);
+
+    void openTiff();
+    void openPng();
+    void decodeTiff(arma::uchar_mat &mask);
+    void decodePng(std::function<void(int, const unsigned char*)> processRow);
+    void decodeRows(std::function<void(int, const unsigned char*)> processRow);
+    void readTiffRegion(arma::uchar_mat &region, int x0, int y0);
+    unsigned char pixelSolid(const unsigned char *row, int i) const;
+};
+//------------------------------------------------------------------------------
+}
+#endif // IMAGEREADER_H
@@ -0,0 +1,65 @@
+#include "labelraster.h"
+
+#include <tiffio.h>
+#include <iostream>
+#include <cstdlib>
+
+//------------------------------------------------------------------------------
+mg::LabelRasterWriter::LabelRasterWriter(std::string fileName, int width,
+                                         int height, int bandRows):
+    fileName(fileName),
+    width(width),
+    height(height),
+    bandRows(bandRows)
+{
+    // Big TIFF, a large raster may exceed 4 GB before compression
+    tif = TIFFOpen(fileName.c_str(), "w8");
+    if(!tif)
+    {
+        std::cerr << "Unable to open " << fileName << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, (uint32_t) width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32_t) height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+    TIFFSetField(tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, (uint32_t) bandRows);
+}
+//------------------------------------------------------------------------------
+mg::LabelRasterWriter::~LabelRasterWriter()
+{
+    close();
+}
+//------------------------------------------------------------------------------
+int mg::LabelRasterWriter::getBandRows() const
+{
+    return bandRows;
+}
+//------------------------------------------------------------------------------
+void mg::LabelRasterWriter::writeBand(uint32_t *labels, int nRows)
+{
+    uint32_t strip = rowsWritten/bandRows;
+    tmsize_t size = (tmsize_t) nRows*width*sizeof(uint32_t);
+    if(TIFFWriteEncodedStrip(tif, strip, labels, size) < 0)
+        std::cerr << "Failed writing rows " << rowsWritten << " to "
+                  << rowsWritten + nRows << " of " << fileName << std::endl;
+    rowsWritten += nRows;
+}
+//------------------------------------------------------------------------------
+void mg::LabelRasterWriter::close()
+{
+    if(!tif)
+        return;
+    if(rowsWritten != height)
+        std::cerr << fileName << ": " << rowsWritten << " of " << height
+                  << " rows written" << std::endl;
+    TIFFClose(tif);
+    tif = nullptr;
+}
+//------------------------------------------------------------------------------
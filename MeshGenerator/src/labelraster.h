@@ -0,0 +1,49 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * Streaming writer for the Voronoi label raster. The raster is written as a
+ * 32 bit unsigned TIFF, deflate compressed with horizontal differencing, one
+ * strip per band of rows, so only a single band is held in memory. Pixel
+ * values are the generator id plus one, and zero in the solid.
+ */
+
+#ifndef LABELRASTER_H
+#define LABELRASTER_H
+
+#include <string>
+#include <stdint.h>
+
+typedef struct tiff TIFF;
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+class LabelRasterWriter
+{
+public:
+    LabelRasterWriter(std::string fileName, int width, int height,
+                      int bandRows);
+    ~LabelRasterWriter();
+
+    int getBandRows() const;
+
+    // Writes the next band of nRows rows, stored row by row. The buffer may
+    // be changed by the compression.
+    void writeBand(uint32_t *labels, int nRows);
+    void close();
+protected:
+    std::string fileName;
+    TIFF *tif = nullptr;
+    int width;
+    int height;
+    int bandRows;
+    int rowsWritten = 0;
+};
+//------------------------------------------------------------------------------
+}
+#endif // LABELRASTER_H
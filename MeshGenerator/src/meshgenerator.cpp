@@ -1,24 +1,73 @@
 #include "meshgenerator.h"
+#include "imagereader.h"
 
 //------------------------------------------------------------------------------
-mg::MeshGenerator::MeshGenerator()
+// Writes the xyz lines of the generators, repeated replicate_x times
+// replicate_y times. Copy (t_x, t_y) of generator i gets the id
+// i + n*(t_x + replicate_x*t_y) and the volume of generator i. The count is
+// taken from the volumes, since x may hold ghosts after the generators.
+//------------------------------------------------------------------------------
+template<class T>
+static void writeXyz(std::ostream &outStream, const arma::Mat<T> &x,
+                     const arma::vec &volumes, int replicate_x,
+                     int replicate_y, double DX, double DY)
+{
+    long n = volumes.n_elem;
+    outStream << n*replicate_x*replicate_y << endl;
+    outStream << "# id x y z volume" << endl;
+
+    long id = 0;
+    for(int t_y=0; t_y<replicate_y; t_y++)
+    {
+        for(int t_x=0; t_x<replicate_x; t_x++)
+        {
+            double shift_x = t_x*DX;
+            double shift_y = t_y*DY;
+            for(int i=0; i<n; i++)
+            {
+                outStream << id << "\t" << x(0, i) + shift_x << "\t"
+                          << x(1, i) + shift_y << "\t" << " 0 " << " "
+                          << volumes[i] << std::endl;
+                id++;
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+template<class T>
+mg::MeshGeneratorT<T>::MeshGeneratorT()
 {
 }
 //------------------------------------------------------------------------------
-mg::MeshGenerator::MeshGenerator(mg::Parameters parameters):
+template<class T>
+mg::MeshGeneratorT<T>::MeshGeneratorT(mg::Parameters parameters):
     param(parameters)
 {
-    image = CImg<double> (parameters.imgPath.c_str());
+    ImageReader reader(parameters.imgPath, parameters.cacheMask);
+    img_data = reader.readMask();
 
-    h = image.height();
-    w = image.width();
-    img_data = arma::mat(h, w);
-    for(int j=0;j<w;j++) {
-        for(int i=0;i<h;i++) {
-            img_data(i,j) = image(j,i,0,0)/(255.0);
-        }
-    }
+    h = img_data.n_rows;
+    w = img_data.n_cols;
+
+    initializeParameters(parameters);
+}
+//------------------------------------------------------------------------------
+template<class T>
+mg::MeshGeneratorT<T>::MeshGeneratorT(mg::Parameters parameters,
+                                      const arma::uchar_mat &imageData):
+    param(parameters),
+    img_data(imageData)
+{
+    h = img_data.n_rows;
+    w = img_data.n_cols;
 
+    initializeParameters(parameters);
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::initializeParameters(mg::Parameters parameters)
+{
     n = parameters.nParticles;
     q = parameters.q;
     threshold = parameters.threshold;
@@ -39,13 +88,15 @@ mg::MeshGenerator::MeshGenerator(mg::Parameters parameters):
         Y_0 = parameters.Y_0;
         Y_1 = parameters.Y_1;
     }
-    x = arma::randu(2,n);
+    x = arma::conv_to<arma::Mat<T>>::from(arma::randu(2,n));
     js = arma::ones(n);
 
     seed = std::chrono::system_clock::now().time_since_epoch().count();
     generator = std::default_random_engine(seed);
-    distribution_x = std::uniform_real_distribution<double> (X_0, X_1);
-    distribution_y = std::uniform_real_distribution<double> (Y_0, Y_1);
+    for(int t=0; t<maxThreads(); t++)
+        generators.push_back(std::default_random_engine(seed + t + 1));
+    distribution_x = std::uniform_real_distribution<T> (X_0, X_1);
+    distribution_y = std::uniform_real_distribution<T> (Y_0, Y_1);
 
     dx  = (X_1 - X_0)/w;
     dy  = (Y_1 - Y_0)/h;
@@ -54,6 +105,9 @@ mg::MeshGenerator::MeshGenerator(mg::Parameters parameters):
 
     periodic_x = parameters.periodic_x;
     periodic_y = parameters.periodic_y;
+    useGhosts = parameters.ghostLayer && (periodic_x || periodic_y);
+    wrap_x = periodic_x && !useGhosts;
+    wrap_y = periodic_y && !useGhosts;
     saveImage = parameters.saveImage;
 
     imageResolution = parameters.imageResolution;
@@ -65,238 +119,740 @@ mg::MeshGenerator::MeshGenerator(mg::Parameters parameters):
     openmp_threads = parameters.openmp_threads;
 }
 //------------------------------------------------------------------------------
-void mg::MeshGenerator::initializeFromImage()
+template<class T>
+void mg::MeshGeneratorT<T>::setGenerators(const arma::mat &x_free,
+                                          const arma::mat &x_fixed,
+                                          const arma::vec &js_free)
+{
+    // The fixed generators are stored after the free generators and are
+    // never moved by the update step.
+    nFixed = x_fixed.n_cols;
+    n = x_free.n_cols + nFixed;
+
+    x = arma::Mat<T>(2, n);
+    for(int i=0; i<(int)x_free.n_cols; i++)
+    {
+        x(0, i) = x_free(0, i);
+        x(1, i) = x_free(1, i);
+    }
+    for(int i=0; i<nFixed; i++)
+    {
+        x(0, x_free.n_cols + i) = x_fixed(0, i);
+        x(1, x_free.n_cols + i) = x_fixed(1, i);
+    }
+
+    // A warm start continues from the iteration counts of the free generators
+    js = arma::ones(n);
+    for(int i=0; i<(int)js_free.n_elem; i++)
+        js(i) = js_free(i);
+    generatorsInitialized = true;
+    givenVolumes.reset();
+
+    setDomainSize(2.01);
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::setVolumes(const arma::vec &volumes)
+{
+    if((int)volumes.n_elem != n)
+    {
+        std::cerr << "Expected " << n << " volumes, got " << volumes.n_elem
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    givenVolumes = volumes;
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::initializeFromImage()
 {
     // Randomly trying points within the image.
     //#pragma omp parallel for
-    for(int i=0; i<n; i++)
+    for(int i=0; i<n - nFixed; i++)
     {
-        arma::vec2 r_i = x.col(i);
+        vec2 r_i = x.col(i);
         do
         {
             r_i[0] = distribution_x(generator);
             r_i[1] = distribution_y(generator);
-        }while(img_data(r_i(1)/dy, r_i(0)/dx) > 0);
+        }while(isSolid(r_i(0), r_i(1)));
         x.col(i) = r_i;
     }
 
     std::cout << "Initialization from image complete" << std::endl;
 }
 //------------------------------------------------------------------------------
-arma::mat mg::MeshGenerator::createMesh()
+template<class T>
+void mg::MeshGeneratorT<T>::initializePoissonDisk()
+{
+    PoissonDiskSampler sampler(img_data, X_0, X_1, Y_0, Y_1,
+                               periodic_x, periodic_y);
+    double radius = param.poissonRadius;
+    if(radius <= 0)
+        radius = sampler.radiusForCount(n);
+    arma::mat x_sampled = sampler.sample(radius, seed);
+    int nSampled = x_sampled.n_cols;
+
+    // The packing estimate may be too optimistic in pore space with much
+    // boundary, the radius is then reduced until enough points are found.
+    bool aimForCount = param.poissonRadius <= 0;
+    for(int attempt=0; aimForCount && nSampled < n && attempt < 8; attempt++)
+    {
+        radius *= std::max(0.5, 0.95*sqrt(double(nSampled)/n));
+        x_sampled = sampler.sample(radius, seed + attempt + 1);
+        nSampled = x_sampled.n_cols;
+    }
+
+    // Removing the surplus at random when aiming for nParticles
+    int nKept = nSampled;
+    if(aimForCount)
+        nKept = std::min(nSampled, n);
+
+    std::vector<int> order(nSampled);
+    for(int i=0; i<nSampled; i++)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), generator);
+
+    // Any shortfall is filled with uniform samples of the pore space
+    int nTotal = aimForCount ? n : nKept;
+    arma::mat x_free(2, nTotal);
+    for(int i=0; i<nKept; i++)
+    {
+        x_free(0, i) = x_sampled(0, order[i]);
+        x_free(1, i) = x_sampled(1, order[i]);
+    }
+    for(int i=nKept; i<nTotal; i++)
+    {
+        do
+        {
+            x_free(0, i) = distribution_x(generator);
+            x_free(1, i) = distribution_y(generator);
+        }while(isSolid(x_free(0, i), x_free(1, i)));
+    }
+    if(nKept < nTotal)
+        std::cout << "Added " << nTotal - nKept << " uniform samples to reach "
+                  << nTotal << " generators" << std::endl;
+    setGenerators(x_free, arma::mat(2, 0));
+
+    std::cout << "Poisson-disk initialization with " << n
+              << " generators complete" << std::endl;
+}
+//------------------------------------------------------------------------------
+template<class T>
+arma::Mat<T> mg::MeshGeneratorT<T>::createMesh()
 {
     createDomainGrid();
-    initializeFromImage();
+    if(!generatorsInitialized)
+        initializeFromImage();
+    if(param.hilbertOrder)
+        sortGenerators();
+    if(param.numaFirstTouch)
+    {
+        firstTouch(x);
+        firstTouch(js);
+        firstTouch(img_data);
+    }
+    if(param.replicateMask)
+        replicateMask();
 
-    std::uniform_real_distribution<double> distribution_rand_particle(X_0, n);
+    std::uniform_real_distribution<double> distribution_rand_particle(0, n - nFixed);
     // Sampling the image Monte Carlo style and adjusting the point centers
     // untill convergence.
 
-//    vector<array<double, 3>> neighbours(n);
-    vector<vector<double>> neighbours(n, vector<double>(3,1));
-
+    // The centroid sums of each generator, stored contiguously and zeroed by
+    // the threads updating them, so the pages are local to those threads.
+    // The adaptive schedule also sums the squared sample offsets.
+    bool adaptiveSamples = param.sampleSchedule == "adaptive";
+    arma::mat neighbours(adaptiveSamples ? 4 : 3, n, arma::fill::none);
 
 #ifdef FORCE_OMP_CPU
         omp_set_num_threads(openmp_threads);
 #endif
 #pragma omp parallel for
     for(int i=0; i<n; i++) {
-        vector<double> &dun = neighbours[i];
-        dun[0] = 0;
-        dun[1] = 0;
-        dun[2] = 0;
+        double *dun = neighbours.colptr(i);
+        for(int d=0; d<(int)neighbours.n_rows; d++)
+            dun[d] = 0;
+    }
+
+    // Convergence is measured as the rms displacement per iteration in units
+    // of the mean generator spacing.
+    double meanSpacing = sqrt(DX*DY/n);
+    AndersonMixing anderson(param.andersonDepth, param.andersonRegularization,
+                            param.andersonRestartFactor);
+    arma::vec periods(2*n);
+    for(int i=0; i<n; i++)
+    {
+        periods(2*i) = periodic_x ? DX : 0;
+        periods(2*i + 1) = periodic_y ? DY : 0;
+    }
+    anderson.setPeriods(periods);
+    arma::vec x_old(2*n);
+    arma::vec sampleCounts = arma::zeros(n);
+    ofstream convergenceStream;
+    if(param.saveConvergence)
+    {
+        convergenceStream.open((basePath + "/convergence.txt").c_str());
+        convergenceStream << "# iteration\trms displacement\taccelerated"
+                          << std::endl;
     }
 
+    int q_k = sampleCount(0, q, 0);
+    long totalSamples = 0;
+    ofstream scheduleStream;
+    if(param.sampleSchedule != "constant")
+    {
+        scheduleStream.open((basePath + "/sample_schedule.txt").c_str());
+        scheduleStream << "# schedule " << param.sampleSchedule
+                       << ", q " << q
+                       << ", start fraction " << param.sampleStartFraction
+                       << ", growth iterations "
+                       << param.sampleGrowthIterations
+                       << ", noise tolerance " << param.sampleNoiseTolerance
+                       << std::endl;
+        scheduleStream << "# iteration\tsamples\tnoise ratio" << std::endl;
+    }
+
+    std::unique_ptr<SnapshotWriter> snapshots;
+    if(param.testingSave && param.snapshotStream)
+        snapshots.reset(new SnapshotWriter(basePath + "/snapshots.mgsnap",
+                                           param.snapshotKeyframes));
+
     for (int k=0; k<threshold;k++) {
 //        std::cout << "k = " << k << std::endl;
         printProgress(double(k)/threshold);
 
+        // Generators close in space are kept close in memory
+        bool reordered = false;
+        if(param.hilbertOrder && k > 0 && k % param.reorderFrequency == 0)
+        {
+            std::vector<int> order = sortGenerators();
+            arma::vec counts = sampleCounts;
+            for(int i=0; i<n; i++)
+                sampleCounts(i) = counts(order[i]);
+            reordered = true;
+        }
+
         checkBoundaries();
-        mapParticlesToGrid();
+        updateSearchIndex();
 
         if(param.testingSave  && k % testSaveFreq == 0)
         {
-            save_image_and_xyz(basePath + "/alg1", k);
-            calculateRadialDistribution(k);
+            if(snapshots)
+            {
+                snapshots->push(k, x.memptr(), n);
+            }
+            else
+            {
+                save_image_and_xyz(basePath + "/alg1", k);
+                calculateRadialDistribution(k);
+            }
         }
 
-        if(k % param.redistributionFrequency == 0)
+        bool redistributed = false;
+        if(k % param.redistributionFrequency == 0 && param.nRedistributedPoints > 0)
         {
-            // Picking nRandom points for redistribution
-            for(int iterations=0; iterations < param.nRedistributedPoints; iterations++)
+            if(param.targetedRedistribution)
             {
-                int random_particle = distribution_rand_particle(generator);
-                do
+                if(k > 0)
+                    redistributed = redistributeTargeted(sampleCounts) > 0;
+                sampleCounts.zeros();
+            }
+            else
+            {
+                // Picking nRandom points for redistribution
+                for(int iterations=0; iterations < param.nRedistributedPoints; iterations++)
                 {
-                    x(0, random_particle) = distribution_x(generator);
-                    x(1, random_particle) = distribution_y(generator);
-                }while(img_data(x(1, random_particle)/dy, x(0, random_particle)/dx) > 0);
+                    int random_particle = distribution_rand_particle(generator);
+                    do
+                    {
+                        x(0, random_particle) = distribution_x(generator);
+                        x(1, random_particle) = distribution_y(generator);
+                    }while(isSolid(x(0, random_particle), x(1, random_particle)));
+                }
+                redistributed = true;
+            }
+
+            if(redistributed)
+            {
+                checkBoundaries();
+                updateSearchIndex();
             }
         }
 
 #ifdef FORCE_OMP_CPU
         omp_set_num_threads(openmp_threads);
 #endif
-#pragma omp parallel for
-        for(int r=0; r<q; r++) {
-            double y_r[2];
-            double maxLen = numeric_limits<double>::max();
-            int indexMax = -1;
-
-            do
-            {
-                y_r[0] = distribution_x(generator);
-                y_r[1] = distribution_y(generator);
-            }while(img_data(y_r[1]/dy, y_r[0]/dx) > 0);
-
-            arma::vec2 y_t = y_r;
-            int gId = findGridId(y_t);
-            double y_tmp[2];
-            y_tmp[0] = y_t(0);
-            y_tmp[1] = y_t(1);
-
-            // Finding the closest voronoi center
-            //------------------------------------------------------------------
-            // Checking this gridpoint
-            //------------------------------------------------------------------
-
-            double x_k[2];
-            double y_r_copy[2];
-            for(int k:particlesInGridPoint[gId])
-            {
-                y_r_copy[0] = y_r[0];
-                y_r_copy[1] = y_r[1];
-                x_k[0] = y_r[0] - x(0, k);
-                x_k[1] = y_r[1] - x(1, k);
-
-                if(periodic_x)
+        // Blocks of samples are balanced dynamically, since rejected samples
+        // and crowded cells make some samples much more expensive.
+        parallelFor(0, q_k, param.sampleBlockSize,
+                    [&](int r_0, int r_1, int thread) {
+            std::default_random_engine &rng = generators[thread];
+            for(int r=r_0; r<r_1; r++) {
+                T y_r[2];
+                T maxLen = numeric_limits<T>::max();
+                int indexMax = -1;
+
+                if(param.sparseGrid)
                 {
-                    if(x_k[0] > 0.5*DX){
-                        x_k[0] -= DX;
-                        y_r_copy[0] -= DX;
-                    }else if(x_k[0] < -0.5*DX){
-                        x_k[0] += DX;
-                        y_r_copy[0] += DX;
-                    }
+                    samplePoreCell(rng, y_r);
                 }
-
-                if(periodic_y)
+                else
                 {
-                    if(x_k[1] > 0.5*DY){
-                        x_k[1] -= DY;
-                        y_r_copy[1] -= DY;
-                    }else if(x_k[1] < -0.5*DY){
-                        x_k[1] += DY;
-                        y_r_copy[1] += DY;
-                    }
+                    do
+                    {
+                        y_r[0] = distribution_x(rng);
+                        y_r[1] = distribution_y(rng);
+                    }while(isSolid(y_r[0], y_r[1]));
                 }
 
-                double dr_rk = x_k[0]*x_k[0] + x_k[1]*x_k[1];
+                vec2 y_t = y_r;
+                T y_tmp[2];
 
-                if(dr_rk < maxLen)
+                if(param.adaptiveIndex)
                 {
-                    maxLen = dr_rk;
-                    indexMax = k;
-                    y_tmp[0] = y_r_copy[0];
-                    y_tmp[1] = y_r_copy[1];
+                    indexMax = generatorTree.nearest(y_r, y_tmp);
                 }
-            }
-
-            //------------------------------------------------------------------
-            // Checking neighbouring gridpoint
-            //------------------------------------------------------------------
-            for(int gridNeighbour:gridNeighbours[gId])
-            {
-                for(int k:particlesInGridPoint[gridNeighbour])
+                else
                 {
-                    y_r_copy[0] = y_r[0];
-                    y_r_copy[1] = y_r[1];
-                    x_k[0] = y_r[0] - x(0, k);
-                    x_k[1] = y_r[1] - x(1, k);
-
-                    if(periodic_x)
+                    int gId = findGridId(y_t);
+                    y_tmp[0] = y_t(0);
+                    y_tmp[1] = y_t(1);
+
+                    // Finding the closest voronoi center
+                    //----------------------------------------------------------
+                    // Checking this gridpoint
+                    //----------------------------------------------------------
+
+                    T x_k[2];
+                    T y_r_copy[2];
+                    for(int k:cellParticles(gId))
                     {
-                        if(x_k[0] > 0.5*DX){
-                            x_k[0] -= DX;
-                            y_r_copy[0] -= DX;
-                        }else if(x_k[0] < -0.5*DX){
-                            x_k[0] += DX;
-                            y_r_copy[0] += DX;
+                        y_r_copy[0] = y_r[0];
+                        y_r_copy[1] = y_r[1];
+                        x_k[0] = y_r[0] - x(0, k);
+                        x_k[1] = y_r[1] - x(1, k);
+
+                        if(wrap_x)
+                        {
+                            if(x_k[0] > 0.5*DX){
+                                x_k[0] -= DX;
+                                y_r_copy[0] -= DX;
+                            }else if(x_k[0] < -0.5*DX){
+                                x_k[0] += DX;
+                                y_r_copy[0] += DX;
+                            }
                         }
-                    }
 
-                    if(periodic_y)
-                    {
-                        if(x_k[1] > 0.5*DY){
-                            x_k[1] -= DY;
-                            y_r_copy[1] -= DY;
-                        }else if(x_k[1] < -0.5*DY){
-                            x_k[1] += DY;
-                            y_r_copy[1] += DY;
+                        if(wrap_y)
+                        {
+                            if(x_k[1] > 0.5*DY){
+                                x_k[1] -= DY;
+                                y_r_copy[1] -= DY;
+                            }else if(x_k[1] < -0.5*DY){
+                                x_k[1] += DY;
+                                y_r_copy[1] += DY;
+                            }
                         }
-                    }
 
-                    double dr_rk = x_k[0]*x_k[0] + x_k[1]*x_k[1];
+                        T dr_rk = x_k[0]*x_k[0] + x_k[1]*x_k[1];
+
+                        if(dr_rk < maxLen)
+                        {
+                            maxLen = dr_rk;
+                            indexMax = k;
+                            y_tmp[0] = y_r_copy[0];
+                            y_tmp[1] = y_r_copy[1];
+                        }
+                    }
 
-                    if(dr_rk < maxLen)
+                    //----------------------------------------------------------
+                    // Checking neighbouring gridpoint
+                    //----------------------------------------------------------
+                    for(int gridNeighbour:neighbourCells(gId))
                     {
-                        maxLen = dr_rk;
-                        indexMax = k;
-                        y_tmp[0] = y_r_copy[0];
-                        y_tmp[1] = y_r_copy[1];
+                        for(int k:cellParticles(gridNeighbour))
+                        {
+                            y_r_copy[0] = y_r[0];
+                            y_r_copy[1] = y_r[1];
+                            x_k[0] = y_r[0] - x(0, k);
+                            x_k[1] = y_r[1] - x(1, k);
+
+                            if(wrap_x)
+                            {
+                                if(x_k[0] > 0.5*DX){
+                                    x_k[0] -= DX;
+                                    y_r_copy[0] -= DX;
+                                }else if(x_k[0] < -0.5*DX){
+                                    x_k[0] += DX;
+                                    y_r_copy[0] += DX;
+                                }
+                            }
+
+                            if(wrap_y)
+                            {
+                                if(x_k[1] > 0.5*DY){
+                                    x_k[1] -= DY;
+                                    y_r_copy[1] -= DY;
+                                }else if(x_k[1] < -0.5*DY){
+                                    x_k[1] += DY;
+                                    y_r_copy[1] += DY;
+                                }
+                            }
+
+                            T dr_rk = x_k[0]*x_k[0] + x_k[1]*x_k[1];
+
+                            if(dr_rk < maxLen)
+                            {
+                                maxLen = dr_rk;
+                                indexMax = k;
+                                y_tmp[0] = y_r_copy[0];
+                                y_tmp[1] = y_r_copy[1];
+                            }
+                        }
                     }
                 }
-            }
-            //------------------------------------------------------------------
-            // Storing the result
-#pragma omp critical
-            {
+                //--------------------------------------------------------------
+                // Storing the result
+                if(indexMax >= n) {
+                    // A ghost, the sample is moved back next to the owner
+                    const std::array<double, 2> &shift = ghosts.shift[indexMax - n];
+                    y_tmp[0] -= shift[0];
+                    y_tmp[1] -= shift[1];
+                    indexMax = ghosts.owner[indexMax - n];
+                }
                 if(indexMax >= 0) {
-                    vector<double> &du = neighbours[indexMax];
+                    double *du = neighbours.colptr(indexMax);
+#pragma omp atomic
                     du[0] += y_tmp[0];
+#pragma omp atomic
                     du[1] += y_tmp[1];
+#pragma omp atomic
                     du[2] += 1;
+                    if(adaptiveSamples)
+                    {
+                        double d_x = y_tmp[0] - x(0, indexMax);
+                        double d_y = y_tmp[1] - x(1, indexMax);
+#pragma omp atomic
+                        du[3] += d_x*d_x + d_y*d_y;
+                    }
                 }
             }
+        }, &samplingBalance);
+
+#pragma omp parallel for
+        for(int i=0; i<n; i++) {
+            x_old(2*i) = x(0, i);
+            x_old(2*i + 1) = x(1, i);
         }
 
+        // Squared standard error of the centroids, summed over generators
+        double noise2 = 0;
+        long nNoise = 0;
 #ifdef FORCE_OMP_CPU
         omp_set_num_threads(openmp_threads);
 #endif
-#pragma omp parallel for
+#pragma omp parallel for reduction(+:noise2, nNoise)
         for(int i=0; i<n; i++) {
-            vector<double> &dun = neighbours[i];
+            double *dun = neighbours.colptr(i);
+
+            sampleCounts(i) += dun[2];
 
-            if(dun[2] <= 0)
+            if(dun[2] <= 0 || i >= n - nFixed)
+            {
+                for(int d=0; d<(int)neighbours.n_rows; d++)
+                    dun[d] = 0;
                 continue;
+            }
+            // The update is computed in double precision from the
+            // accumulated centroid sums.
             double j = js(i);
-            arma::vec2 x_i =  x.col(i);
-            arma::vec2 u_r;
-            u_r[0] = dun[0];
-            u_r[1] = dun[1];
+            double u_r[2];
+            u_r[0] = dun[0]/dun[2];
+            u_r[1] = dun[1]/dun[2];
 
-            u_r /= dun[2];
+            if(adaptiveSamples && dun[2] > 1)
+            {
+                double m_x = u_r[0] - x(0, i);
+                double m_y = u_r[1] - x(1, i);
+                double variance = dun[3]/dun[2] - m_x*m_x - m_y*m_y;
+                noise2 += std::max(variance, 0.0)/dun[2];
+                nNoise++;
+            }
 
-            x.col(i) = ((alpha_1*j + beta_1)*x_i + (alpha_2*j + beta_2)*u_r)/(j+1);
+            for(int d=0; d<2; d++)
+                x(d, i) = ((alpha_1*j + beta_1)*x(d, i) + (alpha_2*j + beta_2)*u_r[d])/(j+1);
             js(i) += 1;
 
-            dun[0] = 0;
-            dun[1] = 0;
-            dun[2] = 0;
+            for(int d=0; d<(int)neighbours.n_rows; d++)
+                dun[d] = 0;
+        }
+
+        //----------------------------------------------------------------------
+        // Anderson acceleration of the fixed-point iteration
+        //----------------------------------------------------------------------
+        arma::vec x_new(2*n);
+        for(int i=0; i<n; i++) {
+            x_new(2*i) = x(0, i);
+            x_new(2*i + 1) = x(1, i);
+        }
+        double residual = arma::norm(x_new - x_old)/sqrt(n)/meanSpacing;
+
+        bool accelerated = false;
+        if(param.andersonAcceleration && k >= param.andersonStart)
+        {
+            // Redistribution changes the map and reordering the numbering, so
+            // the history is discarded.
+            if(redistributed || reordered)
+                anderson.restart();
+            arma::vec x_mixed = anderson.mix(x_old, x_new);
+            accelerated = anderson.lastStepAccelerated();
+            if(accelerated)
+                acceptMixedPositions(x_mixed, x_new, meanSpacing);
+        }
+
+        if(param.saveConvergence)
+            convergenceStream << k << "\t" << residual << "\t" << accelerated
+                              << std::endl;
+
+        // The sampling noise relative to the rms step of this iteration
+        totalSamples += q_k;
+        double noiseRatio = 0;
+        if(nNoise > 0 && residual > 0)
+            noiseRatio = sqrt(noise2/nNoise)/(residual*meanSpacing);
+        if(scheduleStream.is_open())
+            scheduleStream << k << "\t" << q_k << "\t" << noiseRatio
+                           << std::endl;
+        q_k = sampleCount(k + 1, q_k, noiseRatio);
+
+        if(residual < param.convergenceTolerance)
+        {
+            std::cout << std::endl << "Converged after " << k + 1
+                      << " iterations" << std::endl;
+            break;
         }
     }
 
+    if(param.sampleSchedule != "constant")
+        std::cout << "Drew " << totalSamples << " samples, "
+                  << double(totalSamples)/n << " per generator" << std::endl;
+
+    removeGhosts();
+    if(param.hilbertOrder)
+        sortGenerators();
     return x;
 }
 //------------------------------------------------------------------------------
-void mg::MeshGenerator::createDomainGrid()
+template<class T>
+int mg::MeshGeneratorT<T>::sampleCount(int k, int q_k, double noiseRatio)
+{
+    int q_0 = std::max(1, int(param.sampleStartFraction*q));
+    if(param.sampleSchedule == "constant" || q_0 >= q)
+        return q;
+
+    if(param.sampleSchedule == "adaptive")
+    {
+        // The standard error falls as one over the square root of the number
+        // of samples, which are increased to bring the noise down to the
+        // tolerance. The count never decreases.
+        if(k == 0)
+            return q_0;
+        double ratio = noiseRatio/param.sampleNoiseTolerance;
+        if(ratio <= 1)
+            return q_k;
+        return std::min(q, int(std::min(4.0, ratio*ratio)*q_k));
+    }
+
+    int growth = std::max(1, param.sampleGrowthIterations);
+    double t = std::min(1.0, double(k)/growth);
+    if(param.sampleSchedule == "geometric")
+        return std::min(q, int(q_0*pow(double(q)/q_0, t)));
+    return std::min(q, int(q_0 + (q - q_0)*t));
+}
+//------------------------------------------------------------------------------
+template<class T>
+int mg::MeshGeneratorT<T>::redistributeTargeted(const arma::vec &counts)
+{
+    // The number of samples landing in a Voronoi cell is proportional to its
+    // pore area. Generators of the smallest cells are moved into the largest
+    // cells, as long as both deviate clearly from the mean.
+    int nFree = n - nFixed;
+    double meanCount = arma::accu(counts)/n;
+    if(meanCount <= 0)
+        return 0;
+
+    std::vector<int> order(nFree);
+    for(int i=0; i<nFree; i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return counts(a) < counts(b);
+    });
+
+    // The cell sizes are measured in pore area per generator, the domain
+    // area would overshoot the large cell at low porosity. The mask does not
+    // change, so the pore pixels are counted once.
+    if(nPorePixels < 0)
+    {
+        long count = 0;
+#pragma omp parallel for reduction(+:count)
+        for(int j=0; j<w; j++)
+            for(int i=0; i<h; i++)
+                if(img_data(i, j) == 0)
+                    count++;
+        nPorePixels = count;
+    }
+    double spacing = sqrt(nPorePixels*dx*dy/n);
+    std::uniform_real_distribution<double> distribution_angle(0, 2*M_PI);
+    int nMoved = 0;
+
+    for(int m=0; m < param.nRedistributedPoints && m < nFree/2; m++)
+    {
+        int small = order[m];
+        int large = order[nFree - 1 - m];
+        if(counts(small) >= param.redistributionLow*meanCount ||
+                counts(large) <= param.redistributionHigh*meanCount)
+            break;
+
+        // Splitting the large cell: the generator is placed half a cell
+        // radius away from the generator of the large cell.
+        double radius = 0.5*spacing*sqrt(counts(large)/meanCount/M_PI);
+        bool placed = false;
+        for(int attempt=0; attempt<20 && !placed; attempt++)
+        {
+            double angle = distribution_angle(generator);
+            double r[2] = {x(0, large) + radius*cos(angle),
+                           x(1, large) + radius*sin(angle)};
+
+            if(periodic_x)
+                r[0] -= DX*floor((r[0] - X_0)/DX);
+            else if(r[0] < X_0 || r[0] >= X_1)
+                continue;
+            if(periodic_y)
+                r[1] -= DY*floor((r[1] - Y_0)/DY);
+            else if(r[1] < Y_0 || r[1] >= Y_1)
+                continue;
+            if(isSolid(r[0], r[1]))
+                continue;
+
+            x(0, small) = r[0];
+            x(1, small) = r[1];
+            placed = true;
+        }
+        if(!placed)
+            continue;
+
+        // Resetting the iteration counts restarts the damping of both
+        // generators at its first-iteration weights. The next update is
+        // still damped, averaging the position with the centroid.
+        js(small) = 1;
+        js(large) = 1;
+        nMoved++;
+    }
+
+    return nMoved;
+}
+//------------------------------------------------------------------------------
+template<class T>
+std::vector<int> mg::MeshGeneratorT<T>::sortGenerators()
+{
+    // The free generators are sorted by their position along a Hilbert curve
+    // over the domain, the fixed generators stay at the end. Returns the old
+    // index of each generator.
+    removeGhosts();
+    int nFree = n - nFixed;
+    double side = std::max(DX, DY);
+
+    std::vector<uint64_t> keys(nFree);
+#pragma omp parallel for
+    for(int i=0; i<nFree; i++)
+        keys[i] = hilbertIndex((x(0, i) - X_0)/side, (x(1, i) - Y_0)/side);
+
+    std::vector<int> order(n);
+    for(int i=0; i<n; i++)
+        order[i] = i;
+    std::sort(order.begin(), order.begin() + nFree, [&](int a, int b) {
+        return keys[a] < keys[b];
+    });
+
+    arma::Mat<T> x_sorted(2, n);
+    arma::vec js_sorted(n);
+#pragma omp parallel for
+    for(int i=0; i<n; i++)
+    {
+        x_sorted(0, i) = x(0, order[i]);
+        x_sorted(1, i) = x(1, order[i]);
+        js_sorted(i) = js(order[i]);
+    }
+    x = x_sorted;
+    js = js_sorted;
+    if((int)givenVolumes.n_elem == n)
+    {
+        arma::vec volumes = givenVolumes;
+        for(int i=0; i<n; i++)
+            givenVolumes(i) = volumes(order[i]);
+    }
+
+    return order;
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::acceptMixedPositions(const arma::vec &x_mixed,
+                                                 const arma::vec &x_plain,
+                                                 double meanSpacing)
+{
+    // The extrapolated position of a generator is only used if it is a
+    // moderate step from the plain update and lies in the pore space.
+    double maxStep = param.andersonMaxStep*meanSpacing;
+
+#pragma omp parallel for
+    for(int i=0; i<n - nFixed; i++)
+    {
+        double r[2] = {x_mixed(2*i), x_mixed(2*i + 1)};
+        double step = sqrt(pow(r[0] - x_plain(2*i), 2)
+                           + pow(r[1] - x_plain(2*i + 1), 2));
+        if(step > maxStep)
+            continue;
+
+        if(periodic_x)
+            r[0] -= DX*floor((r[0] - X_0)/DX);
+        else if(r[0] < X_0 || r[0] >= X_1)
+            continue;
+
+        if(periodic_y)
+            r[1] -= DY*floor((r[1] - Y_0)/DY);
+        else if(r[1] < Y_0 || r[1] >= Y_1)
+            continue;
+
+        if(isSolid(r[0], r[1]))
+            continue;
+
+        x(0, i) = r[0];
+        x(1, i) = r[1];
+    }
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::createDomainGrid()
 {
+    if(param.sparseGrid)
+    {
+        createSparseGrid();
+        return;
+    }
+
     std::vector<int> pluss_minus = {-1, 0, 1};
     gridNeighbours = std::vector<vector<int>> (nx*ny, std::vector<int>(0));
     particlesInGridPoint.clear();
     particlesInGridPoint = std::vector<vector<int>>(nx*ny, std::vector<int>(0));
 
-    for(int i=0;i<nx;i++)
+    // Built in parallel, so that the neighbour lists are allocated by the
+    // threads and spread over their NUMA nodes
+    int nx_ = nx;
+#ifdef FORCE_OMP_CPU
+        omp_set_num_threads(openmp_threads);
+#endif
+#pragma omp parallel for
+    for(int i=0;i<nx_;i++)
     {
         for(int j=0;j<ny;j++)
         {
@@ -307,14 +863,14 @@ void mg::MeshGenerator::createDomainGrid()
                 id_x += i;
                 if(id_x < 0)
                 {
-                    if(periodic_x)
+                    if(wrap_x)
                         id_x = nx-1;
                     else
                         continue;
                 }
                 if(id_x >= nx)
                 {
-                    if(periodic_x)
+                    if(wrap_x)
                         id_x = 0;
                     else
                         continue;
@@ -325,14 +881,14 @@ void mg::MeshGenerator::createDomainGrid()
                     id_y += j;
                     if(id_y < 0)
                     {
-                        if(periodic_y)
+                        if(wrap_y)
                             id_y = ny-1;
                         else
                             continue;
                     }
                     if(id_y >= ny)
                     {
-                        if(periodic_y)
+                        if(wrap_y)
                             id_y = 0;
                         else
                             continue;
@@ -341,6 +897,13 @@ void mg::MeshGenerator::createDomainGrid()
                     if(id_neighbour == id_ij)
                         continue;
 
+                    // With fewer than three cells in a periodic direction
+                    // the same cell is reached from both sides.
+                    std::vector<int> &neighbours = gridNeighbours[id_ij];
+                    if(std::find(neighbours.begin(), neighbours.end(),
+                                 id_neighbour) != neighbours.end())
+                        continue;
+
                     gridNeighbours[id_ij].push_back(id_neighbour);
                 }
             }
@@ -361,7 +924,8 @@ void mg::MeshGenerator::createDomainGrid()
 //    cout << "done " << endl;
 }
 //------------------------------------------------------------------------------
-void mg::MeshGenerator::mapParticlesToGrid()
+template<class T>
+void mg::MeshGeneratorT<T>::mapParticlesToGrid()
 {
     // Emptying the grid
     for(vector<int> &t:particlesInGridPoint)
@@ -369,16 +933,44 @@ void mg::MeshGenerator::mapParticlesToGrid()
         t.clear();
     }
 
+    // Dropping the cells that were only stored for generators in the solid
+    if(param.sparseGrid)
+    {
+        for(size_t c=nPoreCells; c<cellGridId.size(); c++)
+            cellIndex[cellGridId[c]] = -1;
+        cellGridId.resize(nPoreCells);
+        particlesInGridPoint.resize(nPoreCells);
+    }
+
+    // Refreshing the ghosts for the current positions and cell size
+    updateGhosts();
+
     // Placing all particles in the grid
 #ifdef FORCE_OMP_CPU
         omp_set_num_threads(openmp_threads);
 #endif
 #pragma omp parallel for
-    for(int i=0; i<n; i++)
+    for(int i=0; i<n + nGhost; i++)
     {
-        const arma::vec2 & r_i = x.col(i);
+        const vec2 & r_i = x.col(i);
+        int gId = findGridId(r_i);
 #pragma omp critical
-        particlesInGridPoint[findGridId(r_i)].push_back(i);
+        {
+            if(param.sparseGrid)
+            {
+                if(cellIndex[gId] < 0)
+                {
+                    cellIndex[gId] = cellGridId.size();
+                    cellGridId.push_back(gId);
+                    particlesInGridPoint.push_back(std::vector<int>());
+                }
+                particlesInGridPoint[cellIndex[gId]].push_back(i);
+            }
+            else
+            {
+                particlesInGridPoint[gId].push_back(i);
+            }
+        }
     }
 
 //    // Printing results for debugging
@@ -399,7 +991,22 @@ void mg::MeshGenerator::mapParticlesToGrid()
 //    std::cout << "done " << std::endl;
 }
 //------------------------------------------------------------------------------
-void mg::MeshGenerator::save_image_and_xyz(string base, int nr)
+template<class T>
+void mg::MeshGeneratorT<T>::updateSearchIndex()
+{
+    // With the k-d tree the samples only query the tree, the cell lists are
+    // left to the functions that use them.
+    if(!param.adaptiveIndex)
+    {
+        mapParticlesToGrid();
+        return;
+    }
+    updateGhosts();
+    generatorTree.build(x, n + nGhost, wrap_x, wrap_y, X_0, X_1, Y_0, Y_1);
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::save_image_and_xyz(string base, int nr)
 {
     // Bounds check
     checkBoundaries();
@@ -407,164 +1014,414 @@ void mg::MeshGenerator::save_image_and_xyz(string base, int nr)
 
     string fileName;
     if(nr == -1)
-        fileName = base + ".pgm";
+        fileName = base + ".tif";
     else
-        fileName = base + "_" + to_string(nr) + ".pgm";
-    arma::vec areas = arma::zeros(n);
+        fileName = base + "_" + to_string(nr) + ".tif";
+
+    int resolution_x = X_1*imageResolution;
+    int resolution_y = Y_1*imageResolution;
+    arma::vec areas;
+
+    // Saving the voronoi image as a label raster streamed in bands of rows
+    if(saveImage)
+    {
+        LabelRasterWriter labels(fileName, resolution_x, resolution_y,
+                                 param.rasterBandRows);
+        areas = rasteriseVoronoi(resolution_x, resolution_y, &labels);
+        labels.close();
+    }
+    else if(!param.exactVolumes && givenVolumes.is_empty())
+    {
+        areas = rasteriseVoronoi(resolution_x, resolution_y, nullptr);
+    }
+
+    //--------------------------------------------------------------------------
+    // Saving xyz-file with volume
+    //--------------------------------------------------------------------------
+    if(nr == -1)
+        fileName =  base + ".xyz";
+    else
+        fileName =  base + "_" + to_string(nr) + ".xyz";
+    ofstream outStream(fileName.c_str());
+
+    arma::vec volumes;
+    if(!givenVolumes.is_empty())
+        volumes = givenVolumes;
+    else if(param.exactVolumes)
+        volumes = calculateExactVolumes();
+    else
+        volumes = areasToVolumes(areas, resolution_x, resolution_y);
+    writeXyz(outStream, x, volumes, 1, 1, DX, DY);
+    outStream.close();
+    cout << fileName << endl;
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::writeReplicated(string base)
+{
+    // The converged periodic tile is repeated, streaming the lines so that
+    // only the tile is held in memory
+    arma::vec volumes = calculateVolumes();
+
+    string fileName = base + ".xyz";
+    ofstream outStream(fileName.c_str());
+    writeXyz(outStream, x, volumes, param.replicate_x, param.replicate_y, DX,
+             DY);
+    outStream.close();
+    cout << fileName << endl;
+}
+//------------------------------------------------------------------------------
+template<class T>
+arma::vec mg::MeshGeneratorT<T>::calculateVolumes()
+{
+    checkBoundaries();
+    mapParticlesToGrid();
+
+    if(!givenVolumes.is_empty())
+        return givenVolumes;
+    if(param.exactVolumes)
+        return calculateExactVolumes();
 
     int resolution_x = X_1*imageResolution;
     int resolution_y = Y_1*imageResolution;
-    arma::mat image(resolution_y, resolution_x);
-    image.zeros();
+    arma::vec areas = rasteriseVoronoi(resolution_x, resolution_y, nullptr);
+
+    return areasToVolumes(areas, resolution_x, resolution_y);
+}
+//------------------------------------------------------------------------------
+template<class T>
+arma::vec mg::MeshGeneratorT<T>::rasteriseVoronoi(int resolution_x,
+                                                  int resolution_y,
+                                                  LabelRasterWriter *labels)
+{
+    arma::vec areas = arma::zeros(n);
 
-    int pix_hole = 0;
     //--------------------------------------------------------------------------
-    // Creating a Voronoi image and computing the areas
+    // Creating a Voronoi image and computing the areas. The raster is made in
+    // bands of rows that are streamed to the label writer, so only one band
+    // is held in memory.
     //--------------------------------------------------------------------------
+    if(param.adaptiveIndex)
+        generatorTree.build(x, n + nGhost, wrap_x, wrap_y, X_0, X_1, Y_0, Y_1);
+
+    int bandRows = labels ? labels->getBandRows() : resolution_y;
+    std::vector<uint32_t> band(labels ? (size_t) bandRows*resolution_x : 0);
+
 #ifdef FORCE_OMP_CPU
         omp_set_num_threads(openmp_threads);
 #endif
-#pragma omp parallel for
-    for (int i=0; i<resolution_x;i++)
+    for(int j_0=0; j_0<resolution_y; j_0+=bandRows)
     {
-        for (int j=0; j<resolution_y;j++)
-        {
-            arma::vec2 r_img;
-            r_img[0] = X_1*i/(resolution_x);
-            r_img[1] = Y_1*j/(resolution_y);
+        int j_1 = std::min(resolution_y, j_0 + bandRows);
+        parallelFor(j_0, j_1, 1, [&](int r_0, int r_1, int) {
+            for (int j=r_0; j<r_1; j++)
+            {
+                uint32_t *row = labels ? band.data()
+                                         + (size_t) (j - j_0)*resolution_x
+                                       : nullptr;
+                for (int i=0; i<resolution_x;i++)
+                {
+                    vec2 r_img;
+                    r_img[0] = X_1*i/(resolution_x);
+                    r_img[1] = Y_1*j/(resolution_y);
 
-            double maxLen = numeric_limits<double>::max();
-            int indexMax = -1;
+                    T maxLen = numeric_limits<T>::max();
+                    int indexMax = -1;
 
-            if(img_data(r_img(1)/dy, r_img(0)/dx) > 0){
-                image(j, i) = 0;
-                pix_hole++;
-                continue;
-            }
+                    if(isSolid(r_img(0), r_img(1))){
+                        if(row)
+                            row[i] = 0;
+                        continue;
+                    }
 
-            int gId = findGridId(r_img);
-
-            // Finding the closest voronoi center
-            //------------------------------------------------------------------
-            // Checking this gridpoint
-            //------------------------------------------------------------------
-            for(int k:particlesInGridPoint[gId])
-            {
-                arma::vec2 x_k = r_img - x.col(k);
-
-                if(periodic_x)
-                {
-                    if(x_k(0) > 0.5*DX){
-                        x_k(0) -= DX;
-                    }else if(x_k(0) < -0.5*DX){
-                        x_k(0) += DX;
-                    }
-                }
-
-                if(periodic_y)
-                {
-                    if(x_k(1) > 0.5*DY){
-                        x_k(1) -= DY;
-                    }else if(x_k(1) < -0.5*DY){
-                        x_k(1) += DY;
+                    if(param.adaptiveIndex)
+                    {
+                        T y_image[2];
+                        indexMax = generatorTree.nearest(r_img.memptr(),
+                                                         y_image);
                     }
-                }
-
-                double dr_rk = x_k(0)*x_k(0) + x_k(1)*x_k(1);
-
-                if(dr_rk < maxLen)
-                {
-                    maxLen = dr_rk;
-                    indexMax = k;
-                }
-            }
-
-            //------------------------------------------------------------------
-            // Checking neighbouring gridpoint
-            //------------------------------------------------------------------
-            for(int gridNeighbour:gridNeighbours[gId])
-            {
-                for(int k:particlesInGridPoint[gridNeighbour])
-                {
-                    arma::vec2 x_k = r_img - x.col(k);
-
-                    if(periodic_x)
+                    else
                     {
-                        if(x_k(0) > 0.5*DX){
-                            x_k(0) -= DX;
-                        }else if(x_k(0) < -0.5*DX){
-                            x_k(0) += DX;
+                        int gId = findGridId(r_img);
+
+                        // Finding the closest voronoi center
+                        //------------------------------------------------------
+                        // Checking this gridpoint
+                        //------------------------------------------------------
+                        for(int k:cellParticles(gId))
+                        {
+                            vec2 x_k = r_img - x.col(k);
+
+                            if(wrap_x)
+                            {
+                                if(x_k(0) > 0.5*DX){
+                                    x_k(0) -= DX;
+                                }else if(x_k(0) < -0.5*DX){
+                                    x_k(0) += DX;
+                                }
+                            }
+
+                            if(wrap_y)
+                            {
+                                if(x_k(1) > 0.5*DY){
+                                    x_k(1) -= DY;
+                                }else if(x_k(1) < -0.5*DY){
+                                    x_k(1) += DY;
+                                }
+                            }
+
+                            T dr_rk = x_k(0)*x_k(0) + x_k(1)*x_k(1);
+
+                            if(dr_rk < maxLen)
+                            {
+                                maxLen = dr_rk;
+                                indexMax = k;
+                            }
                         }
-                    }
 
-                    if(periodic_y)
-                    {
-                        if(x_k(1) > 0.5*DY){
-                            x_k(1) -= DY;
-                        }else if(x_k(1) < -0.5*DY){
-                            x_k(1) += DY;
+                        //------------------------------------------------------
+                        // Checking neighbouring gridpoint
+                        //------------------------------------------------------
+                        for(int gridNeighbour:neighbourCells(gId))
+                        {
+                            for(int k:cellParticles(gridNeighbour))
+                            {
+                                vec2 x_k = r_img - x.col(k);
+
+                                if(wrap_x)
+                                {
+                                    if(x_k(0) > 0.5*DX){
+                                        x_k(0) -= DX;
+                                    }else if(x_k(0) < -0.5*DX){
+                                        x_k(0) += DX;
+                                    }
+                                }
+
+                                if(wrap_y)
+                                {
+                                    if(x_k(1) > 0.5*DY){
+                                        x_k(1) -= DY;
+                                    }else if(x_k(1) < -0.5*DY){
+                                        x_k(1) += DY;
+                                    }
+                                }
+
+                                T dr_rk = x_k(0)*x_k(0) + x_k(1)*x_k(1);
+
+                                if(dr_rk < maxLen)
+                                {
+                                    maxLen = dr_rk;
+                                    indexMax = k;
+                                }
+                            }
                         }
                     }
 
-                    double dr_rk = x_k(0)*x_k(0) + x_k(1)*x_k(1);
+                    if(indexMax >= n)
+                        indexMax = ghosts.owner[indexMax - n];
 
-                    if(dr_rk < maxLen)
+                    if(indexMax != -1)
                     {
-                        maxLen = dr_rk;
-                        indexMax = k;
+                        if(row)
+                            row[i] = indexMax + 1;
+#pragma omp atomic
+                        areas[indexMax] += 1.0;
+                    }else if(row)
+                    {
+                        row[i] = 0;
                     }
                 }
             }
+        }, &rasterBalance);
 
-            if(indexMax != -1)
-            {
-                image(j, i) = indexMax;
-                areas[indexMax] += 1.0;
-            }else
+        if(labels)
+            labels->writeBand(band.data(), j_1 - j_0);
+    }
+
+    return areas;
+}
+//------------------------------------------------------------------------------
+template<class T>
+mg::Polygon mg::MeshGeneratorT<T>::voronoiCell(int i)
+{
+    // The cell is built relative to the generator, starting from the domain
+    // or, in periodic directions, from the box bounded by its own images.
+    double r_x = x(0, i);
+    double r_y = x(1, i);
+    double x_0 = periodic_x ? -0.5*DX : X_0 - r_x;
+    double x_1 = periodic_x ? 0.5*DX : X_1 - r_x;
+    double y_0 = periodic_y ? -0.5*DY : Y_0 - r_y;
+    double y_1 = periodic_y ? 0.5*DY : Y_1 - r_y;
+    Polygon cell = {{{x_0, y_0}}, {{x_1, y_0}}, {{x_1, y_1}}, {{x_0, y_1}}};
+
+    // Cutting with the bisectors of the generators in rings of grid cells
+    // around the generator, until the remaining generators are further away
+    // than twice the furthest vertex of the cell.
+    int nx_ = nx;
+    int ny_ = ny;
+    vec2 r_i = x.col(i);
+    int gId = findGridId(r_i);
+    int c_x = gId/ny_;
+    int c_y = gId%ny_;
+
+    // In periodic directions each column of cells is visited once
+    int min_x = wrap_x ? -(nx_ - 1)/2 : -c_x;
+    int max_x = wrap_x ? nx_/2 : nx_ - 1 - c_x;
+    int min_y = wrap_y ? -(ny_ - 1)/2 : -c_y;
+    int max_y = wrap_y ? ny_/2 : ny_ - 1 - c_y;
+    double ringWidth = std::min(gridSpacing_x, gridSpacing_y);
+
+    for(int ring=0; ; ring++)
+    {
+        bool cellsLeft = false;
+        for(int d_x=std::max(-ring, min_x); d_x<=std::min(ring, max_x); d_x++)
+        {
+            for(int d_y=std::max(-ring, min_y); d_y<=std::min(ring, max_y);
+                d_y++)
             {
-                image(j, i) = 0;
+                if(std::max(std::abs(d_x), std::abs(d_y)) != ring)
+                    continue;
+                cellsLeft = true;
+
+                int g_x = (c_x + d_x + nx_)%nx_;
+                int g_y = (c_y + d_y + ny_)%ny_;
+                for(int k:cellParticles(g_y + ny_*g_x))
+                {
+                    if(k == i)
+                        continue;
+                    double d[2] = {x(0, k) - r_x, x(1, k) - r_y};
+                    if(wrap_x)
+                        d[0] -= DX*round(d[0]/DX);
+                    if(wrap_y)
+                        d[1] -= DY*round(d[1]/DY);
+
+                    clipHalfPlane(cell, d[0], d[1],
+                                  0.5*(d[0]*d[0] + d[1]*d[1]));
+                }
             }
         }
+
+        double radius2 = 0;
+        for(const std::array<double, 2> &v:cell)
+            radius2 = std::max(radius2, v[0]*v[0] + v[1]*v[1]);
+        double searched = ring*ringWidth;
+        if(!cellsLeft || searched*searched >= 4*radius2)
+            break;
     }
 
-    // Adding the voronoi centers to the image
-    for (int k=0;k<n; k++)
-        image(x(1, k)*resolution_y/Y_1, x(0, k)*resolution_x) = 1.0;
+    for(std::array<double, 2> &v:cell)
+    {
+        v[0] += r_x;
+        v[1] += r_y;
+    }
+    return cell;
+}
+//------------------------------------------------------------------------------
+template<class T>
+bool mg::MeshGeneratorT<T>::isPorePixel(int col, int row)
+{
+    // Periodic images wrap around, otherwise the edge pixels are extended
+    if(periodic_x)
+        col = (col%w + w)%w;
+    else
+        col = std::max(0, std::min(col, w - 1));
+    if(periodic_y)
+        row = (row%h + h)%h;
+    else
+        row = std::max(0, std::min(row, h - 1));
+    return img_data(row, col) == 0;
+}
+//------------------------------------------------------------------------------
+template<class T>
+arma::vec mg::MeshGeneratorT<T>::calculateExactVolumes()
+{
+    // The pore space is vectorised with marching squares between the pixel
+    // centres. Each marching squares cell holds a convex piece of pore
+    // space, which is clipped against the Voronoi cells it overlaps.
+    arma::vec volumes = arma::zeros(n);
 
-    // Saving the voronoi image
-    if(saveImage)
-        image.save(fileName, arma::pgm_binary);
+#ifdef FORCE_OMP_CPU
+        omp_set_num_threads(openmp_threads);
+#endif
+#pragma omp parallel for schedule(dynamic, 64)
+    for(int i=0; i<n; i++)
+        volumes[i] = exactVolume(i);
 
-    //--------------------------------------------------------------------------
-    // Saving xyz-file with volume
-    //--------------------------------------------------------------------------
-    if(nr == -1)
-        fileName =  base + ".xyz";
-    else
-        fileName =  base + "_" + to_string(nr) + ".xyz";
-    ofstream outStream(fileName.c_str());
+    return volumes;
+}
+//------------------------------------------------------------------------------
+template<class T>
+double mg::MeshGeneratorT<T>::exactVolume(int i)
+{
+    double height = 1.0;
+    Polygon cell = voronoiCell(i);
+    if(cell.empty())
+        return 0;
 
-    outStream << x.n_cols << endl;
-    outStream << "# id x y z volume" << endl;
+    double x_min = cell[0][0], x_max = cell[0][0];
+    double y_min = cell[0][1], y_max = cell[0][1];
+    for(const std::array<double, 2> &v:cell)
+    {
+        x_min = std::min(x_min, v[0]);
+        x_max = std::max(x_max, v[0]);
+        y_min = std::min(y_min, v[1]);
+        y_max = std::max(y_max, v[1]);
+    }
+
+    // Marching squares cell (a, b) has its lower left corner in the
+    // centre of pixel (a, b)
+    int a_0 = floor(x_min/dx - 0.5);
+    int a_1 = floor(x_max/dx - 0.5);
+    int b_0 = floor(y_min/dy - 0.5);
+    int b_1 = floor(y_max/dy - 0.5);
+
+    double area = 0;
+    Polygon piece;
+    for(int a=a_0; a<=a_1; a++)
+    {
+        double s_x = (a + 0.5)*dx;
+        for(int b=b_0; b<=b_1; b++)
+        {
+            double s_y = (b + 0.5)*dy;
+            bool pore[4] = {isPorePixel(a, b), isPorePixel(a + 1, b),
+                            isPorePixel(a + 1, b + 1),
+                            isPorePixel(a, b + 1)};
+            if(!pore[0] && !pore[1] && !pore[2] && !pore[3])
+                continue;
+
+            marchingSquaresPiece(pore, s_x, s_y, dx, dy, piece);
+
+            bool inside = insideConvex(cell, s_x, s_y) &&
+                    insideConvex(cell, s_x + dx, s_y) &&
+                    insideConvex(cell, s_x + dx, s_y + dy) &&
+                    insideConvex(cell, s_x, s_y + dy);
+            area += inside ? polygonArea(piece) : clippedArea(piece, cell);
+        }
+    }
+    return area*height;
+}
+//------------------------------------------------------------------------------
+template<class T>
+arma::vec mg::MeshGeneratorT<T>::areasToVolumes(const arma::vec &areas,
+                                                int resolution_x,
+                                                int resolution_y)
+{
+    arma::vec volumes(n);
     double dxdy = (X_1 - X_0)*(Y_1 - Y_0);
     double height = 1.0;
-    double s_volume = 0;
 //    double total_pix = resolution_x*resolution_y - pix_hole;
-    double total_pix = resolution_x*resolution_y;
+    double total_pix = (double)resolution_x*resolution_y;
 //    double optimalPackingOfCircles = 0.907;
     double optimalPackingOfCircles = 1.0    ;
     for (int i=0; i<n;i++)
     {
-        double volume = optimalPackingOfCircles*dxdy*height* areas[i]/(total_pix);
-        const arma::vec2& r = x.col(i);
-        outStream << i << "\t" << r[0] << "\t" << r[1] << "\t"<< " 0 " << " " << volume << std::endl;
-        s_volume += volume;
+        volumes[i] = optimalPackingOfCircles*dxdy*height* areas[i]/(total_pix);
     }
-    outStream.close();
-    cout << fileName << endl;
+    return volumes;
 }
 //------------------------------------------------------------------------------
-void mg::MeshGenerator::setDomainSize(double spacing)
+template<class T>
+void mg::MeshGeneratorT<T>::setDomainSize(double spacing)
 {
     // Setting the grid size
     double rho = n/(DX*DY);
@@ -585,7 +1442,8 @@ void mg::MeshGenerator::setDomainSize(double spacing)
         ny = 1;
 }
 //------------------------------------------------------------------------------
-double mg::MeshGenerator::calculateRadialDistribution(int nr)
+template<class T>
+double mg::MeshGeneratorT<T>::calculateRadialDistribution(int nr)
 {
     std::cout << "Calculating histogram" << std::endl;
     setDomainSize(4.01);
@@ -604,20 +1462,20 @@ double mg::MeshGenerator::calculateRadialDistribution(int nr)
 #pragma omp parallel for
     for(int i=0; i<n; i++)
     {
-        const arma::vec2 & r_i = x.col(i);
+        const vec2 & r_i = x.col(i);
         int gId = findGridId(r_i);
 
-        //------------------------------------------------------------------
+        //----------------------------------------------------------------------
         // Checking this gridpoint
-        //------------------------------------------------------------------
+        //----------------------------------------------------------------------
 
-        for(int k:particlesInGridPoint[gId])
+        for(int k:cellParticles(gId))
         {
-            if(k == i)
+            if(k == i || (k >= n && ghosts.owner[k - n] == i))
                 continue;
-            arma::vec2 r_ij = r_i - x.col(k);
+            vec2 r_ij = r_i - x.col(k);
 
-            if(periodic_x)
+            if(wrap_x)
             {
                 if(r_ij(0) > 0.5*DX){
                     r_ij(0) -= DX;
@@ -626,7 +1484,7 @@ double mg::MeshGenerator::calculateRadialDistribution(int nr)
                 }
             }
 
-            if(periodic_y)
+            if(wrap_y)
             {
                 if(r_ij(1) > 0.5*DY){
                     r_ij(1) -= DY;
@@ -642,16 +1500,18 @@ double mg::MeshGenerator::calculateRadialDistribution(int nr)
             histogram[id]++;
         }
 
-        //------------------------------------------------------------------
+        //----------------------------------------------------------------------
         // Checking neighbouring gridpoint
-        //------------------------------------------------------------------
-        for(int gridNeighbour:gridNeighbours[gId])
+        //----------------------------------------------------------------------
+        for(int gridNeighbour:neighbourCells(gId))
         {
-            for(int k:particlesInGridPoint[gridNeighbour])
+            for(int k:cellParticles(gridNeighbour))
             {
-                arma::vec2 r_ij = r_i - x.col(k);
+                if(k >= n && ghosts.owner[k - n] == i)
+                    continue;
+                vec2 r_ij = r_i - x.col(k);
 
-                if(periodic_x)
+                if(wrap_x)
                 {
                     if(r_ij(0) > 0.5*DX){
                         r_ij(0) -= DX;
@@ -660,7 +1520,7 @@ double mg::MeshGenerator::calculateRadialDistribution(int nr)
                     }
                 }
 
-                if(periodic_y)
+                if(wrap_y)
                 {
                     if(r_ij(1) > 0.5*DY){
                         r_ij(1) -= DY;
@@ -676,7 +1536,7 @@ double mg::MeshGenerator::calculateRadialDistribution(int nr)
                 histogram[id]++;
             }
         }
-        //------------------------------------------------------------------
+        //----------------------------------------------------------------------
     }
     string fileName;
     if(nr == -1)
@@ -720,54 +1580,632 @@ double mg::MeshGenerator::calculateRadialDistribution(int nr)
     return optimalGridSpacing;
 }
 //------------------------------------------------------------------------------
-void mg::MeshGenerator::writeConfiguration()
+template<class T>
+template<class F>
+void mg::MeshGeneratorT<T>::forNeighbours(int i, double radius, F f)
+{
+    // Visits the generators within the radius of generator i in the cells
+    // around it. Ghosts are skipped and periodic neighbours found by the
+    // minimum image, so each neighbour is seen once for radii below half
+    // the period.
+    int nx_ = nx;
+    int ny_ = ny;
+    vec2 r_i = x.col(i);
+    int gId = findGridId(r_i);
+    int c_x = gId/ny_;
+    int c_y = gId%ny_;
+
+    int rings_x = ceil(radius/gridSpacing_x);
+    int rings_y = ceil(radius/gridSpacing_y);
+    int min_x = periodic_x ? -std::min(rings_x, (nx_ - 1)/2)
+                           : std::max(-rings_x, -c_x);
+    int max_x = periodic_x ? std::min(rings_x, nx_/2)
+                           : std::min(rings_x, nx_ - 1 - c_x);
+    int min_y = periodic_y ? -std::min(rings_y, (ny_ - 1)/2)
+                           : std::max(-rings_y, -c_y);
+    int max_y = periodic_y ? std::min(rings_y, ny_/2)
+                           : std::min(rings_y, ny_ - 1 - c_y);
+    double radius2 = radius*radius;
+
+    for(int d_x=min_x; d_x<=max_x; d_x++)
+    {
+        int g_x = (c_x + d_x + nx_)%nx_;
+        for(int d_y=min_y; d_y<=max_y; d_y++)
+        {
+            int g_y = (c_y + d_y + ny_)%ny_;
+            for(int k:cellParticles(g_y + ny_*g_x))
+            {
+                if(k >= n || k == i)
+                    continue;
+                double r_ij[2] = {r_i(0) - x(0, k), r_i(1) - x(1, k)};
+                if(periodic_x)
+                    r_ij[0] -= DX*round(r_ij[0]/DX);
+                if(periodic_y)
+                    r_ij[1] -= DY*round(r_ij[1]/DY);
+
+                double dr2 = r_ij[0]*r_ij[0] + r_ij[1]*r_ij[1];
+                if(dr2 <= radius2)
+                    f(k, dr2);
+            }
+        }
+    }
+}
+//------------------------------------------------------------------------------
+template<class T>
+mg::MeshStatistics mg::MeshGeneratorT<T>::postProcess(string base)
+{
+    // The histogram covers the same distances as with the grid of
+    // calculateRadialDistribution
+    setDomainSize(4.01);
+    int nBins = 300;
+    double maxLength = 1.6*gridSpacing_x;
+    double histSpacing = maxLength/nBins;
+
+    // A single index, the grid of the nearest generator searches, serves
+    // the raster, the Voronoi cells and the neighbour traversal.
+    setDomainSize(2.01);
+    createDomainGrid();
+    checkBoundaries();
+    mapParticlesToGrid();
+
+    int resolution_x = X_1*imageResolution;
+    int resolution_y = Y_1*imageResolution;
+    arma::vec areas;
+    if(saveImage)
+    {
+        LabelRasterWriter labels(base + ".tif", resolution_x, resolution_y,
+                                 param.rasterBandRows);
+        areas = rasteriseVoronoi(resolution_x, resolution_y, &labels);
+        labels.close();
+    }
+    else if(!param.exactVolumes && givenVolumes.is_empty())
+    {
+        areas = rasteriseVoronoi(resolution_x, resolution_y, nullptr);
+    }
+
+    //--------------------------------------------------------------------------
+    // One pass over the generators for the exact volumes, the radial
+    // distribution and the nearest neighbour distances
+    //--------------------------------------------------------------------------
+    bool computeExact = param.exactVolumes && givenVolumes.is_empty();
+    arma::vec volumes;
+    if(!givenVolumes.is_empty())
+        volumes = givenVolumes;
+    else if(param.exactVolumes)
+        volumes = arma::vec(n);
+    else
+        volumes = areasToVolumes(areas, resolution_x, resolution_y);
+    std::vector<std::vector<long>> histograms(maxThreads(),
+                                              std::vector<long>(nBins, 0));
+    arma::vec nearest(n);
+
+#ifdef FORCE_OMP_CPU
+        omp_set_num_threads(openmp_threads);
+#endif
+#pragma omp parallel for schedule(dynamic, 64)
+    for(int i=0; i<n; i++)
+    {
+        std::vector<long> &histogram = histograms[omp_get_thread_num()];
+        double nearest2 = numeric_limits<double>::max();
+        forNeighbours(i, maxLength, [&](int, double dr2) {
+            int id = std::min(nBins - 1, int(sqrt(dr2)/histSpacing));
+            histogram[id]++;
+            nearest2 = std::min(nearest2, dr2);
+        });
+        nearest[i] = std::min(sqrt(nearest2), maxLength);
+
+        if(computeExact)
+            volumes[i] = exactVolume(i);
+    }
+
+    std::vector<long> histogram(nBins, 0);
+    for(const std::vector<long> &h_t:histograms)
+        for(int b=0; b<nBins; b++)
+            histogram[b] += h_t[b];
+
+    // Finding the optimal spacing between the particles
+    arma::vec density = arma::zeros(nBins);
+    int maxIndex = -1;
+    double maxValue = 0;
+    for(int b=1; b<nBins; b++)
+    {
+        double r1 = b*histSpacing;
+        double r2 = r1 + histSpacing;
+        density[b] = histogram[b]/(M_PI*(pow(r2,2) - pow(r1,2)));
+        if(density[b] > maxValue)
+        {
+            maxIndex = b;
+            maxValue = density[b];
+        }
+    }
+    optimalGridSpacing = (maxIndex + 0.5)*histSpacing;
+
+    //--------------------------------------------------------------------------
+    // The outputs are written concurrently from copies of the results
+    //--------------------------------------------------------------------------
+    OutputWriter output;
+    arma::Mat<T> positions = x.cols(0, n - 1);
+    int replicate_x = param.replicate_x;
+    int replicate_y = param.replicate_y;
+    double DX_ = DX;
+    double DY_ = DY;
+    output.write(base + ".xyz", [=](std::ostream &outStream) {
+        writeXyz(outStream, positions, volumes, replicate_x, replicate_y,
+                 DX_, DY_);
+    });
+    output.write(basePath + "/histogram.hist", [=](std::ostream &outStream) {
+        for(int b=1; b<nBins; b++)
+            outStream << (b + 0.5)*histSpacing << "\t" << density[b]
+                      << std::endl;
+    });
+    string configurationName = basePath + "/configuration.cfg";
+    int nTotal = n*replicate_x*replicate_y;
+    double spacing = optimalGridSpacing;
+    double X_0_ = X_0;
+    double Y_0_ = Y_0;
+    bool periodic_x_ = periodic_x;
+    bool periodic_y_ = periodic_y;
+    output.submit([=]() {
+        mg::writeConfiguration(configurationName, nTotal, spacing, X_0_,
+                               X_0_ + replicate_x*DX_, Y_0_,
+                               Y_0_ + replicate_y*DY_, periodic_x_,
+                               periodic_y_);
+    });
+
+    MeshStatistics stats = volumeStatistics(volumes);
+    stats.meanNeighbourDistance = arma::accu(nearest)/n;
+    stats.minNeighbourDistance = nearest.min();
+    if(param.saveMetrics)
+    {
+        output.write(basePath + "/metrics.txt", [=](std::ostream &outStream) {
+            writeStatistics(outStream, stats);
+        });
+    }
+
+    output.wait();
+    return stats;
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::writeBondList(string fileName, double horizon)
+{
+    // The cell list is rebuilt with cells at least one horizon wide, so that
+    // all bonds are found in the neighbouring cells.
+    double rho = n/(DX*DY);
+    setDomainSize(horizon*sqrt(rho));
+    createDomainGrid();
+    checkBoundaries();
+    mapParticlesToGrid();
+
+    if((wrap_x && horizon > 0.5*DX) || (wrap_y && horizon > 0.5*DY))
+        std::cerr << "The horizon exceeds half the periodic domain, bonds to "
+                  << "periodic images beyond the nearest are ignored"
+                  << std::endl;
+
+    double horizon2 = horizon*horizon;
+    // With replication the periodic image of each neighbour is kept as well,
+    // coded as (s_x + 1) + 3*(s_y + 1) for shifts of -1, 0 or 1 tiles
+    int copies = param.replicate_x*param.replicate_y;
+    std::vector<uint8_t> images;
+
+    auto findBonds = [&](int i, int *ids, double *lengths, uint8_t *image) {
+        int nBonds = 0;
+        const vec2 & r_i = x.col(i);
+        int gId = findGridId(r_i);
+
+        auto checkGridPoint = [&](int gridPoint) {
+            for(int k:cellParticles(gridPoint))
+            {
+                int owner = k < n ? k : ghosts.owner[k - n];
+                if(owner == i)
+                    continue;
+                double r_ij[2];
+                r_ij[0] = r_i(0) - x(0, k);
+                r_ij[1] = r_i(1) - x(1, k);
+
+                if(wrap_x)
+                {
+                    if(r_ij[0] > 0.5*DX){
+                        r_ij[0] -= DX;
+                    }else if(r_ij[0] < -0.5*DX){
+                        r_ij[0] += DX;
+                    }
+                }
+
+                if(wrap_y)
+                {
+                    if(r_ij[1] > 0.5*DY){
+                        r_ij[1] -= DY;
+                    }else if(r_ij[1] < -0.5*DY){
+                        r_ij[1] += DY;
+                    }
+                }
+
+                double dr2 = r_ij[0]*r_ij[0] + r_ij[1]*r_ij[1];
+                if(dr2 > horizon2)
+                    continue;
+                if(ids)
+                {
+                    ids[nBonds] = owner;
+                    lengths[nBonds] = sqrt(dr2);
+                }
+                if(image)
+                {
+                    int s_x = (int) round((r_i(0) - r_ij[0] - x(0, owner))/DX);
+                    int s_y = (int) round((r_i(1) - r_ij[1] - x(1, owner))/DY);
+                    image[nBonds] = (s_x + 1) + 3*(s_y + 1);
+                }
+                nBonds++;
+            }
+        };
+
+        checkGridPoint(gId);
+        for(int gridNeighbour:neighbourCells(gId))
+            checkGridPoint(gridNeighbour);
+
+        return nBonds;
+    };
+
+    // Counting the bonds, then filling the compressed rows
+    std::vector<uint64_t> offsets(n + 1, 0);
+
+#ifdef FORCE_OMP_CPU
+        omp_set_num_threads(openmp_threads);
+#endif
+#pragma omp parallel for schedule(dynamic, 256)
+    for(int i=0; i<n; i++)
+        offsets[i + 1] = findBonds(i, nullptr, nullptr, nullptr);
+
+    for(int i=0; i<n; i++)
+        offsets[i + 1] += offsets[i];
+
+    uint64_t nBonds = offsets[n];
+    std::vector<int32_t> ids(nBonds);
+    std::vector<double> lengths(nBonds);
+    if(copies > 1)
+        images.resize(nBonds);
+
+#pragma omp parallel for schedule(dynamic, 256)
+    for(int i=0; i<n; i++)
+    {
+        int *ids_i = ids.data() + offsets[i];
+        double *lengths_i = lengths.data() + offsets[i];
+        uint8_t *images_i = copies > 1 ? images.data() + offsets[i] : nullptr;
+        int nBonds_i = findBonds(i, ids_i, lengths_i, images_i);
+
+        // Sorting each row by neighbour id
+        if(copies == 1)
+        {
+            std::vector<std::pair<int, double>> row(nBonds_i);
+            for(int b=0; b<nBonds_i; b++)
+                row[b] = std::make_pair(ids_i[b], lengths_i[b]);
+            std::sort(row.begin(), row.end());
+            for(int b=0; b<nBonds_i; b++)
+            {
+                ids_i[b] = row[b].first;
+                lengths_i[b] = row[b].second;
+            }
+        }
+    }
+
+    // The rows of a replicated tile, with neighbour ids in the copy they
+    // point into and sorted again, since the order changes with the copy.
+    auto replicatedRow = [&](int copy, int i,
+                             std::vector<std::pair<int32_t, double>> &row) {
+        int t_x = copy % param.replicate_x;
+        int t_y = copy / param.replicate_x;
+        row.clear();
+        for(uint64_t b=offsets[i]; b<offsets[i + 1]; b++)
+        {
+            int s_x = images[b] % 3 - 1;
+            int s_y = images[b] / 3 - 1;
+            int c_x = (t_x + s_x + param.replicate_x) % param.replicate_x;
+            int c_y = (t_y + s_y + param.replicate_y) % param.replicate_y;
+            int32_t id = ids[b] + n*(c_x + param.replicate_x*c_y);
+            row.push_back(std::make_pair(id, lengths[b]));
+        }
+        std::sort(row.begin(), row.end());
+    };
+
+    //--------------------------------------------------------------------------
+    // Binary layout, all sections 8 byte aligned:
+    // char[8] "MGBONDS1", uint64 nParticles, uint64 nBonds, double horizon,
+    // uint64 flags (1 = bond lengths included), uint64 offsets[nParticles+1],
+    // int32 ids[nBonds] padded to 8 bytes, double lengths[nBonds].
+    //--------------------------------------------------------------------------
+    ofstream outStream(fileName.c_str(), ios::binary);
+    const char magic[8] = {'M', 'G', 'B', 'O', 'N', 'D', 'S', '1'};
+    uint64_t nParticles = uint64_t(n)*copies;
+    uint64_t nBondsTotal = nBonds*copies;
+    uint64_t flags = param.saveBondLengths ? 1 : 0;
+    outStream.write(magic, sizeof(magic));
+    outStream.write((const char*) &nParticles, sizeof(nParticles));
+    outStream.write((const char*) &nBondsTotal, sizeof(nBondsTotal));
+    outStream.write((const char*) &horizon, sizeof(horizon));
+    outStream.write((const char*) &flags, sizeof(flags));
+    if(copies == 1)
+    {
+        outStream.write((const char*) offsets.data(), offsets.size()*sizeof(uint64_t));
+        outStream.write((const char*) ids.data(), ids.size()*sizeof(int32_t));
+    }
+    else
+    {
+        // Streaming the copies one row at a time, the ids and lengths are
+        // rebuilt for each section instead of holding the full list.
+        for(int copy=0; copy<copies; copy++)
+        {
+            for(int i=0; i<n; i++)
+            {
+                uint64_t offset = offsets[i] + copy*nBonds;
+                outStream.write((const char*) &offset, sizeof(offset));
+            }
+        }
+        outStream.write((const char*) &nBondsTotal, sizeof(nBondsTotal));
+
+        std::vector<std::pair<int32_t, double>> row;
+        for(int copy=0; copy<copies; copy++)
+        {
+            for(int i=0; i<n; i++)
+            {
+                replicatedRow(copy, i, row);
+                for(const auto &bond:row)
+                    outStream.write((const char*) &bond.first, sizeof(int32_t));
+            }
+        }
+    }
+    if(nBondsTotal % 2 == 1)
+    {
+        int32_t padding = -1;
+        outStream.write((const char*) &padding, sizeof(padding));
+    }
+    if(param.saveBondLengths)
+    {
+        if(copies == 1)
+        {
+            outStream.write((const char*) lengths.data(), lengths.size()*sizeof(double));
+        }
+        else
+        {
+            std::vector<std::pair<int32_t, double>> row;
+            for(int copy=0; copy<copies; copy++)
+            {
+                for(int i=0; i<n; i++)
+                {
+                    replicatedRow(copy, i, row);
+                    for(const auto &bond:row)
+                        outStream.write((const char*) &bond.second, sizeof(double));
+                }
+            }
+        }
+    }
+    outStream.close();
+
+    std::cout << fileName << ": " << nBondsTotal << " bonds, horizon "
+              << horizon << std::endl;
+
+    // Resetting the grid
+    setDomainSize(2.01);
+    createDomainGrid();
+    mapParticlesToGrid();
+}
+//------------------------------------------------------------------------------
+template<class T>
+arma::vec mg::MeshGeneratorT<T>::getIterationCounts()
+{
+    return js;
+}
+//------------------------------------------------------------------------------
+template<class T>
+double mg::MeshGeneratorT<T>::getOptimalGridSpacing()
+{
+    return optimalGridSpacing;
+}
+//------------------------------------------------------------------------------
+template<class T>
+mg::MeshStatistics mg::MeshGeneratorT<T>::calculateStatistics()
+{
+    // The optimal grid spacing is the one found by the last call to
+    // calculateRadialDistribution.
+    return volumeStatistics(calculateVolumes());
+}
+//------------------------------------------------------------------------------
+template<class T>
+mg::MeshStatistics mg::MeshGeneratorT<T>::volumeStatistics(
+        const arma::vec &volumes)
+{
+    MeshStatistics stats;
+    stats.nParticles = n;
+    stats.totalVolume = arma::accu(volumes);
+    stats.meanVolume = stats.totalVolume/n;
+    stats.minVolume = volumes.min();
+    stats.maxVolume = volumes.max();
+
+    double variance = 0;
+    for(int i=0; i<n; i++)
+    {
+        variance += pow(volumes[i] - stats.meanVolume, 2);
+        if(volumes[i] <= 0)
+            stats.emptyCells++;
+    }
+    stats.stdVolume = sqrt(variance/n);
+    stats.optimalGridSpacing = optimalGridSpacing;
+
+    return stats;
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::writeLoadBalance()
+{
+    samplingBalance.write(basePath + "/load_balance_sampling.txt", "Sampling");
+    rasterBalance.write(basePath + "/load_balance_volumes.txt", "Volumes");
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::writeConfiguration()
 {
     std::cout << "Writing configuration" << std::endl;
     string fileName = basePath + "/configuration.cfg";
-    ofstream outStream(fileName.c_str());
-    outStream.setf(ios::scientific);
-    outStream.precision(5);
-
-    outStream << "nParticles = " << n << std::endl;
-    outStream << "spacing = " << optimalGridSpacing << std::endl;
-    int n_x = floor((X_1 - X_0)/optimalGridSpacing);
-    int n_y = floor((Y_1 - Y_0)/optimalGridSpacing);
-    outStream << "latticePoints = [" << n_x<< ", " << n_y << ", " << "1]"
-              << std::endl;
-    outStream << "boundaries = [" << X_0 << ", " << X_1 <<  ", "
-              << Y_0 << ", " << Y_1 << ", "
-              << -0.5*optimalGridSpacing << ", " << 0.5*optimalGridSpacing << "]"
-              << std::endl;
+    mg::writeConfiguration(fileName, n*param.replicate_x*param.replicate_y,
+                           optimalGridSpacing, X_0,
+                           X_0 + param.replicate_x*DX, Y_0,
+                           Y_0 + param.replicate_y*DY, periodic_x, periodic_y);
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::updateGhosts()
+{
+    if(!useGhosts)
+        return;
 
-    outStream << "periodic = [";
-    if(periodic_x)
-        outStream << "1, ";
-    else
-        outStream << "0, ";
+    // Generators within one cell of a periodic edge are copied to the other
+    // side, so that the ghosts fill the cells just outside the domain.
+    removeGhosts();
 
-    if(periodic_y)
-        outStream << "1, ";
+    double width_x = gridSpacing_x;
+    double width_y = gridSpacing_y;
+    for(int i=0; i<n; i++)
+    {
+        double shifts_x[3] = {0, 0, 0};
+        double shifts_y[3] = {0, 0, 0};
+        int nShifts_x = 1;
+        int nShifts_y = 1;
+
+        if(periodic_x)
+        {
+            if(x(0, i) < X_0 + width_x)
+                shifts_x[nShifts_x++] = DX;
+            if(x(0, i) >= X_1 - width_x)
+                shifts_x[nShifts_x++] = -DX;
+        }
+        if(periodic_y)
+        {
+            if(x(1, i) < Y_0 + width_y)
+                shifts_y[nShifts_y++] = DY;
+            if(x(1, i) >= Y_1 - width_y)
+                shifts_y[nShifts_y++] = -DY;
+        }
+
+        for(int a=0; a<nShifts_x; a++)
+        {
+            for(int b=0; b<nShifts_y; b++)
+            {
+                if(a == 0 && b == 0)
+                    continue;
+                ghosts.owner.push_back(i);
+                ghosts.shift.push_back({{shifts_x[a], shifts_y[b]}});
+            }
+        }
+    }
+
+    // Resizing x reallocates it, with first touch the copy is made in
+    // parallel so that the placement of the generators survives
+    nGhost = ghosts.owner.size();
+    if(x.n_cols != (arma::uword) (n + nGhost))
+    {
+        if(param.numaFirstTouch)
+            firstTouchResize(x, n + nGhost);
+        else
+            x.resize(2, n + nGhost);
+    }
+    for(int g=0; g<nGhost; g++)
+    {
+        int owner = ghosts.owner[g];
+        x(0, n + g) = x(0, owner) + ghosts.shift[g][0];
+        x(1, n + g) = x(1, owner) + ghosts.shift[g][1];
+    }
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::removeGhosts()
+{
+    if(nGhost == 0)
+        return;
+
+    if(param.numaFirstTouch)
+        firstTouchResize(x, n);
     else
-        outStream << "0, ";
+        x.resize(2, n);
+    ghosts.owner.clear();
+    ghosts.shift.clear();
+    nGhost = 0;
+}
+//------------------------------------------------------------------------------
+template<class T>
+bool mg::MeshGeneratorT<T>::isSolid(T r_x, T r_y)
+{
+    // Clamping the pixel index, a single precision sample may be rounded up
+    // to the upper boundary.
+    int i = std::max(0, std::min(int(r_y/dy), h - 1));
+    int j = std::max(0, std::min(int(r_x/dx), w - 1));
+    if(!maskReplicas.empty())
+        return maskReplicas[threadNode[omp_get_thread_num()]](i, j) > 0;
+    return img_data(i, j) > 0;
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::replicateMask()
+{
+    // The mask is read at random positions by every sample, each node gets
+    // its own copy written by the threads running on it. The threads should
+    // be pinned, otherwise they may later run on another node.
+    int nNodes = numaNodeCount();
+    if(nNodes < 2)
+        return;
+
+#ifdef FORCE_OMP_CPU
+        omp_set_num_threads(openmp_threads);
+#endif
+    threadNode.assign(maxThreads(), 0);
+    maskReplicas.assign(nNodes, arma::uchar_mat());
+    std::vector<int> nodeThreads(nNodes, 0);
 
+#pragma omp parallel
+    {
+#pragma omp critical
+        {
+            threadNode[omp_get_thread_num()] = currentNode();
+        }
+#pragma omp barrier
+#pragma omp single
+        {
+            for(int t=0; t<omp_get_num_threads(); t++)
+                nodeThreads[threadNode[t]]++;
+            for(int node=0; node<nNodes; node++)
+                if(nodeThreads[node] > 0)
+                    maskReplicas[node].set_size(h, w);
+        }
 
-    outStream << "0]" << std::endl;
+        // The threads of a node share the columns of its copy
+        int thread = omp_get_thread_num();
+        int node = threadNode[thread];
+        int rank = 0;
+        for(int t=0; t<thread; t++)
+            if(threadNode[t] == node)
+                rank++;
+        int j_0 = (long) w*rank/nodeThreads[node];
+        int j_1 = (long) w*(rank + 1)/nodeThreads[node];
+        for(int j=j_0; j<j_1; j++)
+            std::copy(img_data.colptr(j), img_data.colptr(j) + h,
+                      maskReplicas[node].colptr(j));
+    }
 
-    outStream.close();
+    std::cout << "Pore mask replicated on " << nNodes << " NUMA nodes"
+              << std::endl;
 }
 //------------------------------------------------------------------------------
-int mg::MeshGenerator::findGridId(const arma::vec2 &r)
+template<class T>
+int mg::MeshGeneratorT<T>::findGridId(const vec2 &r)
 {
     int id_x = (r(0) - X_0)/gridSpacing_x;
     int id_y = (r(1) - Y_0)/gridSpacing_y;
 
-    // Boundary checks
-    if(id_x > nx)
+    // Boundary checks, ghosts outside the domain are placed in the edge cells
+    if(id_x >= nx)
         id_x = nx - 1;
     else if(id_x < 0)
         id_x = 0;
 
-    if(id_y > ny)
+    if(id_y >= ny)
         id_y = ny - 1;
     else if(id_y < 0)
         id_y = 0;
@@ -775,7 +2213,174 @@ int mg::MeshGenerator::findGridId(const arma::vec2 &r)
     return id_y + ny*id_x;
 }
 //------------------------------------------------------------------------------
-void mg::MeshGenerator::checkBoundaries()
+template<class T>
+void mg::MeshGeneratorT<T>::createSparseGrid()
+{
+    int nx_ = nx;
+    int ny_ = ny;
+    gridNeighbours.clear();
+
+    // The exact pore area of each cell, from the overlap with the pixels
+    std::vector<double> poreArea(nx_*ny_, 0);
+#ifdef FORCE_OMP_CPU
+        omp_set_num_threads(openmp_threads);
+#endif
+#pragma omp parallel for
+    for(int i=0; i<nx_; i++)
+    {
+        double x_0 = X_0 + i*gridSpacing_x;
+        double x_1 = x_0 + gridSpacing_x;
+        int p_0 = std::max(0, int(x_0/dx));
+        int p_1 = std::min(w - 1, int(x_1/dx));
+
+        for(int j=0; j<ny_; j++)
+        {
+            double y_0 = Y_0 + j*gridSpacing_y;
+            double y_1 = y_0 + gridSpacing_y;
+            int q_0 = std::max(0, int(y_0/dy));
+            int q_1 = std::min(h - 1, int(y_1/dy));
+
+            double area = 0;
+            for(int p=p_0; p<=p_1; p++)
+            {
+                // Overlaps below the resolution of single precision
+                // samples could never be hit
+                double overlap_x = std::min(x_1, (p + 1)*dx) -
+                        std::max(x_0, p*dx);
+                if(overlap_x <= 1e-3*dx)
+                    continue;
+                for(int q=q_0; q<=q_1; q++)
+                {
+                    if(img_data(q, p) > 0)
+                        continue;
+                    double overlap_y = std::min(y_1, (q + 1)*dy) -
+                            std::max(y_0, q*dy);
+                    if(overlap_y > 1e-3*dy)
+                        area += overlap_x*overlap_y;
+                }
+            }
+            poreArea[j + ny_*i] = area;
+        }
+    }
+
+    cellIndex.assign(nx_*ny_, -1);
+    cellGridId.clear();
+    cumulativePoreArea.clear();
+    double totalArea = 0;
+    for(int c=0; c<nx_*ny_; c++)
+    {
+        if(poreArea[c] <= 0)
+            continue;
+        totalArea += poreArea[c];
+        cellIndex[c] = cellGridId.size();
+        cellGridId.push_back(c);
+        cumulativePoreArea.push_back(totalArea);
+    }
+    nPoreCells = cellGridId.size();
+
+    particlesInGridPoint.clear();
+    particlesInGridPoint.resize(nPoreCells);
+}
+//------------------------------------------------------------------------------
+template<class T>
+const std::vector<int> &mg::MeshGeneratorT<T>::cellParticles(int gId) const
+{
+    if(!param.sparseGrid)
+        return particlesInGridPoint[gId];
+
+    int c = cellIndex[gId];
+    return c < 0 ? emptyCell : particlesInGridPoint[c];
+}
+//------------------------------------------------------------------------------
+template<class T>
+mg::CellStencil mg::MeshGeneratorT<T>::neighbourCells(int gId) const
+{
+    CellStencil stencil;
+    if(!param.sparseGrid)
+    {
+        for(int neighbour:gridNeighbours[gId])
+            stencil.cells[stencil.size++] = neighbour;
+        return stencil;
+    }
+
+    // The stencil is built on the fly, skipping cells that are not stored
+    int nx_ = nx;
+    int ny_ = ny;
+    int i = gId/ny_;
+    int j = gId%ny_;
+    for(int id_x=i-1; id_x<=i+1; id_x++)
+    {
+        int i_n = id_x;
+        if(i_n < 0 || i_n >= nx_)
+        {
+            if(!wrap_x)
+                continue;
+            i_n = (i_n + nx_)%nx_;
+        }
+
+        for(int id_y=j-1; id_y<=j+1; id_y++)
+        {
+            int j_n = id_y;
+            if(j_n < 0 || j_n >= ny_)
+            {
+                if(!wrap_y)
+                    continue;
+                j_n = (j_n + ny_)%ny_;
+            }
+
+            int neighbour = j_n + ny_*i_n;
+            if(neighbour == gId || cellIndex[neighbour] < 0)
+                continue;
+
+            // With fewer than three cells in a periodic direction the same
+            // cell is reached from both sides.
+            if(std::find(stencil.begin(), stencil.end(), neighbour) !=
+                    stencil.end())
+                continue;
+
+            stencil.cells[stencil.size++] = neighbour;
+        }
+    }
+    return stencil;
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::samplePoreCell(std::default_random_engine &rng,
+                                           T y[2])
+{
+    // A cell is drawn with a probability proportional to its pore area, and
+    // a pore position uniformly within the cell, which is uniform over the
+    // pore space as a whole.
+    std::uniform_real_distribution<double>
+            distribution_area(0, cumulativePoreArea.back());
+    double a = distribution_area(rng);
+    int c = std::upper_bound(cumulativePoreArea.begin(),
+                             cumulativePoreArea.end(), a) -
+            cumulativePoreArea.begin();
+    c = std::min(c, nPoreCells - 1);
+
+    int i = cellGridId[c]/int(ny);
+    int j = cellGridId[c]%int(ny);
+    std::uniform_real_distribution<T>
+            distribution_cell_x(X_0 + i*gridSpacing_x,
+                                X_0 + (i + 1)*gridSpacing_x);
+    std::uniform_real_distribution<T>
+            distribution_cell_y(Y_0 + j*gridSpacing_y,
+                                Y_0 + (j + 1)*gridSpacing_y);
+
+    // Drawing within the cell until the pore space is hit. Redrawing the
+    // cell would sample cells with little pore space too rarely.
+    while(true)
+    {
+        y[0] = distribution_cell_x(rng);
+        y[1] = distribution_cell_y(rng);
+        if(!isSolid(y[0], y[1]))
+            return;
+    }
+}
+//------------------------------------------------------------------------------
+template<class T>
+void mg::MeshGeneratorT<T>::checkBoundaries()
 {
     if(periodic_x)
     {
@@ -803,7 +2408,8 @@ void mg::MeshGenerator::checkBoundaries()
 }
 
 //------------------------------------------------------------------------------
-void mg::MeshGenerator::printProgress(double progress)
+template<class T>
+void mg::MeshGeneratorT<T>::printProgress(double progress)
 {
     int barWidth = 70;
 
@@ -821,3 +2427,6 @@ void mg::MeshGenerator::printProgress(double progress)
     std::cout.flush();
 }
 //------------------------------------------------------------------------------
+template class mg::MeshGeneratorT<double>;
+template class mg::MeshGeneratorT<float>;
+//------------------------------------------------------------------------------
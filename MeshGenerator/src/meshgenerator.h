@@ -17,13 +17,24 @@
 #include <unordered_map>
 #include <boost/filesystem.hpp>
 #include <random>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <stdint.h>
 //#include <chrono>
 #include <omp.h>
 
 #include "mg_functions.h"
+#include "parallelfor.h"
+#include "andersonmixing.h"
+#include "snapshotstream.h"
+#include "generatortree.h"
+#include "polygon.h"
+#include "poissondisk.h"
+#include "numa.h"
+#include "labelraster.h"
+#include "outputwriter.h"
 
-#include <CImg.h>
-using namespace cimg_library;
 using namespace std;
 
 //------------------------------------------------------------------------------
@@ -52,6 +63,7 @@ struct Parameters
 
     bool periodic_x = false;
     bool periodic_y = false;
+    bool ghostLayer = false;
 
     string basePath = "/media/Media4/Scratch/MeshGenerator/tmp";
     string imgPath = "";
@@ -60,36 +72,188 @@ struct Parameters
     bool testingSave = false;
     int testSaveFreq = 100;
 
+    // Debug output as a compressed time series of positions, written in the
+    // background, instead of images and histograms every testSaveFreq
+    bool snapshotStream = false;
+    int snapshotKeyframes = 10;
+
+    // Expands a snapshot stream into the images, xyz files and histograms of
+    // each stored step instead of generating a mesh
+    string expandSnapshots = "";
+
     int redistributionFrequency = 100;
     int nRedistributedPoints = 0;
 
+    // Moves generators of cells with fewer than redistributionLow times the
+    // mean number of samples into cells with more than redistributionHigh
+    // times the mean, instead of moving random generators
+    bool targetedRedistribution = false;
+    double redistributionLow = 0.5;
+    double redistributionHigh = 1.5;
+
+    // Anderson acceleration of the update step, the maximum step is in units
+    // of the mean generator spacing
+    bool andersonAcceleration = false;
+    int andersonDepth = 5;
+    int andersonStart = 50;
+    double andersonRegularization = 1e-6;
+    double andersonRestartFactor = 2.0;
+    double andersonMaxStep = 0.25;
+
+    // Stops when the rms displacement per iteration, in units of the mean
+    // generator spacing, falls below the tolerance
+    double convergenceTolerance = 0;
+    bool saveConvergence = false;
+
     int openmp_threads = 2;
+    int sampleBlockSize = 1024;
+    bool reportLoadBalance = false;
     bool saveImage = false;
+    int rasterBandRows = 256;
+
+    // Volumes, radial distribution and metrics in one pass over the
+    // generators after meshing, with the outputs written concurrently
+    bool fusedPostProcessing = false;
+    bool saveMetrics = false;
+    bool cacheMask = true;
+
+    // Exact nearest generator search in a k-d tree over the generators,
+    // instead of the uniform grid sized from the mean density
+    bool adaptiveIndex = false;
+
+    // Stores only grid cells containing pore space or generators, and draws
+    // the samples cell by cell weighted with the pore area of each cell
+    bool sparseGrid = false;
+
+    // Renumbers the generators along a Hilbert curve at the start, every
+    // reorderFrequency iterations and before the output
+    bool hilbertOrder = false;
+    int reorderFrequency = 100;
+
+    // Volumes from the Voronoi cells clipped against the marching squares
+    // boundary of the pore space, instead of rasterising the cells
+    bool exactVolumes = false;
+
+    // Poisson-disk initialisation followed by lloydIterations CVT iterations
+    // instead of threshold, the radius is found from nParticles when zero
+    bool poissonDisk = false;
+    double poissonRadius = 0;
+    int lloydIterations = 10;
+
+    // Single precision positions, optionally compared against a double
+    // precision reference run
+    bool singlePrecision = false;
+    bool validatePrecision = false;
+
+    // Peridynamic bond lists, the horizon is either given directly or as a
+    // multiple of the optimal grid spacing
+    bool saveBonds = false;
+    double horizon = 0;
+    double horizonFactor = 3.015;
+    bool saveBondLengths = true;
+
+    // Out-of-core tiled processing, sizes in pixels
+    bool tiled = false;
+    int tileSize = 2048;
+    int tileHalo = 128;
+
+    // Warm-started remeshing of a previous mesh after the image changed, the
+    // buffer is in generator spacings
+    bool remesh = false;
+    string previousImgPath = "";
+    string previousMeshPath = "";
+    string previousIterationCountsPath = "";
+    double remeshBuffer = 4.0;
+    bool saveIterationCounts = false;
+
+    // Copies of a periodic tile written side by side, in each direction
+    int replicate_x = 1;
+    int replicate_y = 1;
+
+    // NUMA placement on multi-socket nodes: parallel first touch of the
+    // large arrays, a copy of the pore mask per node, and thread pinning
+    // with threadAffinity "close" or "spread"
+    bool numaFirstTouch = false;
+    bool replicateMask = false;
+    string threadAffinity = "";
+
+    // Samples per iteration. "constant" draws q every iteration, "geometric"
+    // and "linear" grow from sampleStartFraction*q to q over
+    // sampleGrowthIterations, and "adaptive" grows when the standard error
+    // of the centroids exceeds sampleNoiseTolerance times the step.
+    string sampleSchedule = "constant";
+    double sampleStartFraction = 0.1;
+    int sampleGrowthIterations = 100;
+    double sampleNoiseTolerance = 0.25;
 };
 //------------------------------------------------------------------------------
-class MeshGenerator
+// Copies of generators close to a periodic edge, shifted by one period. The
+// ghost positions are stored after the generators they are copied from, and
+// each ghost maps back to its owner, which in a domain-decomposed run may
+// equally well be held by another domain.
+//------------------------------------------------------------------------------
+struct GhostLayer
+{
+    std::vector<int> owner;
+    std::vector<std::array<double, 2>> shift;
+};
+//------------------------------------------------------------------------------
+// The neighbouring cells of a grid cell, at most eight.
+//------------------------------------------------------------------------------
+struct CellStencil
+{
+    int cells[8];
+    int size = 0;
+
+    const int *begin() const { return cells; }
+    const int *end() const { return cells + size; }
+};
+//------------------------------------------------------------------------------
+// The generator positions are stored and compared in the scalar type T,
+// while centroid sums, volumes and the update step use double precision.
+//------------------------------------------------------------------------------
+template<class T>
+class MeshGeneratorT
 {
 public:
-    MeshGenerator();
-    MeshGenerator(Parameters parameters);
+    typedef typename arma::Col<T>::template fixed<2> vec2;
+
+    MeshGeneratorT();
+    MeshGeneratorT(Parameters parameters);
+    MeshGeneratorT(Parameters parameters, const arma::uchar_mat &imageData);
     void initializeFromImage();
-    arma::mat createMesh();
+    void initializePoissonDisk();
+    void setGenerators(const arma::mat &x_free, const arma::mat &x_fixed,
+                       const arma::vec &js_free = arma::vec());
+    void setVolumes(const arma::vec &volumes);
+    arma::Mat<T> createMesh();
 
     void createDomainGrid();
     void mapParticlesToGrid();
     void save_image_and_xyz(string base, int nr = -1);
+    void writeReplicated(string base);
+    MeshStatistics postProcess(string base);
+    arma::vec calculateVolumes();
     void setDomainSize(double spacing);
     double calculateRadialDistribution(int nr = -1);
+    void writeBondList(string fileName, double horizon);
+    double getOptimalGridSpacing();
+    arma::vec getIterationCounts();
+    MeshStatistics calculateStatistics();
+    void writeLoadBalance();
     void writeConfiguration();
 protected:
     Parameters param;
 
-    // From image
-    CImg<double> image;
-
+    // From image, solid pixels are 1 and pore pixels 0
     int h;
     int w;
-    arma::mat img_data;
+    arma::uchar_mat img_data;
+
+    // Read-only copies of the mask on each NUMA node, and the node of each
+    // pinned thread
+    std::vector<arma::uchar_mat> maskReplicas;
+    std::vector<int> threadNode;
 
     int n;
     int q;
@@ -104,15 +268,34 @@ protected:
     double Y_0;
     double Y_1;
 
-    arma::mat x;
+    arma::Mat<T> x;
     arma::vec js;
+    int nFixed = 0;
+    bool generatorsInitialized = false;
+
+    // Volumes known from a previous mesh, used instead of computing them
+    arma::vec givenVolumes;
     std::vector<std::vector<int>> gridNeighbours;
     std::vector<std::vector<int>> particlesInGridPoint;
+    GeneratorTreeT<T> generatorTree;
+
+    // Sparse grid: the compact index of each grid cell, or -1 when it is not
+    // stored, the grid cell of each stored cell and the cumulative pore area
+    // of the nPoreCells cells containing pore space, which come first.
+    std::vector<int> cellIndex;
+    std::vector<int> cellGridId;
+    std::vector<double> cumulativePoreArea;
+    int nPoreCells = 0;
+    std::vector<int> emptyCell;
+
+    // Pore pixels of the mask, counted on first use
+    long nPorePixels = -1;
 
     unsigned seed;
     std::default_random_engine generator;
-    std::uniform_real_distribution<double> distribution_x;
-    std::uniform_real_distribution<double> distribution_y;
+    std::vector<std::default_random_engine> generators;
+    std::uniform_real_distribution<T> distribution_x;
+    std::uniform_real_distribution<T> distribution_y;
 
 
     double dx;
@@ -123,7 +306,14 @@ protected:
     bool periodic_x;
     bool periodic_y;
 
-    double optimalGridSpacing;
+    // Minimum image distances are only needed without the ghost layer
+    bool useGhosts = false;
+    bool wrap_x;
+    bool wrap_y;
+    GhostLayer ghosts;
+    int nGhost = 0;
+
+    double optimalGridSpacing = 0;
 
     // Domain variables
     int dim = 2;
@@ -135,14 +325,45 @@ protected:
     int testSaveFreq;
     bool saveImage = false;
 
-    int findGridId(const arma::vec2 & r_i);
+    void initializeParameters(Parameters parameters);
+    int redistributeTargeted(const arma::vec &counts);
+    std::vector<int> sortGenerators();
+    int sampleCount(int k, int q_k, double noiseRatio);
+    void acceptMixedPositions(const arma::vec &x_mixed,
+                              const arma::vec &x_plain, double meanSpacing);
+    void updateSearchIndex();
+    void updateGhosts();
+    void removeGhosts();
+    bool isSolid(T r_x, T r_y);
+    void replicateMask();
+    int findGridId(const vec2 & r_i);
+    void createSparseGrid();
+    const std::vector<int> &cellParticles(int gId) const;
+    CellStencil neighbourCells(int gId) const;
+    void samplePoreCell(std::default_random_engine &rng, T y[2]);
     void checkBoundaries();
+    arma::vec rasteriseVoronoi(int resolution_x, int resolution_y,
+                               LabelRasterWriter *labels);
+    arma::vec areasToVolumes(const arma::vec &areas, int resolution_x,
+                             int resolution_y);
+    Polygon voronoiCell(int i);
+    arma::vec calculateExactVolumes();
+    double exactVolume(int i);
+    MeshStatistics volumeStatistics(const arma::vec &volumes);
+    template<class F>
+    void forNeighbours(int i, double radius, F f);
+    bool isPorePixel(int col, int row);
 
     int openmp_threads;
+    LoadBalance samplingBalance;
+    LoadBalance rasterBalance;
 
     void printProgress(double progress);
 };
 //------------------------------------------------------------------------------
+typedef MeshGeneratorT<double> MeshGenerator;
+typedef MeshGeneratorT<float> MeshGeneratorFloat;
+//------------------------------------------------------------------------------
 // Functions
 //------------------------------------------------------------------------------
 //void save_xyz(arma::mat &x, std::string base, int i);
@@ -1,2 +1,127 @@
 #include "mg_functions.h"
 
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+void mg::writeConfiguration(std::string fileName, int n, double spacing,
+                            double X_0, double X_1, double Y_0, double Y_1,
+                            bool periodic_x, bool periodic_y)
+{
+    std::ofstream outStream(fileName.c_str());
+    outStream.setf(std::ios::scientific);
+    outStream.precision(5);
+
+    outStream << "nParticles = " << n << std::endl;
+    outStream << "spacing = " << spacing << std::endl;
+    int n_x = floor((X_1 - X_0)/spacing);
+    int n_y = floor((Y_1 - Y_0)/spacing);
+    outStream << "latticePoints = [" << n_x<< ", " << n_y << ", " << "1]"
+              << std::endl;
+    outStream << "boundaries = [" << X_0 << ", " << X_1 <<  ", "
+              << Y_0 << ", " << Y_1 << ", "
+              << -0.5*spacing << ", " << 0.5*spacing << "]"
+              << std::endl;
+
+    outStream << "periodic = [";
+    if(periodic_x)
+        outStream << "1, ";
+    else
+        outStream << "0, ";
+
+    if(periodic_y)
+        outStream << "1, ";
+    else
+        outStream << "0, ";
+
+
+    outStream << "0]" << std::endl;
+
+    outStream.close();
+}
+//------------------------------------------------------------------------------
+void mg::compareStatistics(std::string fileName, const MeshStatistics &stats,
+                           const MeshStatistics &reference)
+{
+    std::ofstream outStream(fileName.c_str());
+    outStream.setf(std::ios::scientific);
+    outStream.precision(5);
+
+    outStream << "# quantity\tvalue\treference\trelative difference"
+              << std::endl;
+    auto write = [&](std::string name, double value, double ref) {
+        double relative = ref != 0 ? (value - ref)/ref : value - ref;
+        outStream << name << "\t" << value << "\t" << ref << "\t" << relative
+                  << std::endl;
+        std::cout << std::setw(20) << std::left << name << value << "\t"
+                  << ref << "\t" << relative << std::endl;
+    };
+
+    write("nParticles", stats.nParticles, reference.nParticles);
+    write("totalVolume", stats.totalVolume, reference.totalVolume);
+    write("meanVolume", stats.meanVolume, reference.meanVolume);
+    write("stdVolume", stats.stdVolume, reference.stdVolume);
+    write("minVolume", stats.minVolume, reference.minVolume);
+    write("maxVolume", stats.maxVolume, reference.maxVolume);
+    write("emptyCells", stats.emptyCells, reference.emptyCells);
+    write("optimalGridSpacing", stats.optimalGridSpacing,
+          reference.optimalGridSpacing);
+    write("meanNeighbourDistance", stats.meanNeighbourDistance,
+          reference.meanNeighbourDistance);
+    write("minNeighbourDistance", stats.minNeighbourDistance,
+          reference.minNeighbourDistance);
+
+    outStream.close();
+}
+//------------------------------------------------------------------------------
+void mg::writeStatistics(std::ostream &outStream, const MeshStatistics &stats)
+{
+    outStream.setf(std::ios::scientific);
+    outStream.precision(5);
+
+    outStream << "# quantity\tvalue" << std::endl;
+    outStream << "nParticles\t" << stats.nParticles << std::endl;
+    outStream << "totalVolume\t" << stats.totalVolume << std::endl;
+    outStream << "meanVolume\t" << stats.meanVolume << std::endl;
+    outStream << "stdVolume\t" << stats.stdVolume << std::endl;
+    outStream << "minVolume\t" << stats.minVolume << std::endl;
+    outStream << "maxVolume\t" << stats.maxVolume << std::endl;
+    outStream << "emptyCells\t" << stats.emptyCells << std::endl;
+    outStream << "optimalGridSpacing\t" << stats.optimalGridSpacing
+              << std::endl;
+    outStream << "meanNeighbourDistance\t" << stats.meanNeighbourDistance
+              << std::endl;
+    outStream << "minNeighbourDistance\t" << stats.minNeighbourDistance
+              << std::endl;
+}
+//------------------------------------------------------------------------------
+uint64_t mg::hilbertIndex(double u, double v, int order)
+{
+    uint64_t side = uint64_t(1) << order;
+    uint64_t x = std::min(side - 1, uint64_t(std::max(0.0, u)*side));
+    uint64_t y = std::min(side - 1, uint64_t(std::max(0.0, v)*side));
+
+    uint64_t d = 0;
+    for(uint64_t s=side/2; s>0; s/=2)
+    {
+        uint64_t rx = (x & s) > 0;
+        uint64_t ry = (y & s) > 0;
+        d += s*s*((3*rx) ^ ry);
+
+        // Rotating the quadrant
+        if(ry == 0)
+        {
+            if(rx == 1)
+            {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+//------------------------------------------------------------------------------
@@ -1,5 +1,40 @@
 #ifndef MG_FUNCTIONS_H
 #define MG_FUNCTIONS_H
 
+#include <string>
+#include <ostream>
+#include <stdint.h>
 
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+struct MeshStatistics
+{
+    int nParticles = 0;
+    double totalVolume = 0;
+    double meanVolume = 0;
+    double stdVolume = 0;
+    double minVolume = 0;
+    double maxVolume = 0;
+    int emptyCells = 0;
+    double optimalGridSpacing = 0;
+    double meanNeighbourDistance = 0;
+    double minNeighbourDistance = 0;
+};
+//------------------------------------------------------------------------------
+void compareStatistics(std::string fileName, const MeshStatistics &stats,
+                       const MeshStatistics &reference);
+void writeStatistics(std::ostream &outStream, const MeshStatistics &stats);
+void writeConfiguration(std::string fileName, int n, double spacing,
+                        double X_0, double X_1, double Y_0, double Y_1,
+                        bool periodic_x, bool periodic_y);
+
+// Position along a Hilbert curve through a 2^order x 2^order grid over the
+// unit square.
+uint64_t hilbertIndex(double u, double v, int order = 20);
+//------------------------------------------------------------------------------
+}
 #endif // MG_FUNCTIONS_H
@@ -0,0 +1,114 @@
+#include "numa.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <omp.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+//------------------------------------------------------------------------------
+std::vector<int> mg::cpuNodes()
+{
+    int nCpus = 1;
+#ifdef __linux__
+    nCpus = std::max(1L, sysconf(_SC_NPROCESSORS_CONF));
+#endif
+    std::vector<int> nodes(nCpus, 0);
+
+    // Each node lists its CPUs as ranges, e.g. "0-15,32-47"
+    for(int node=0; ; node++)
+    {
+        std::ifstream inStream("/sys/devices/system/node/node"
+                               + std::to_string(node) + "/cpulist");
+        if(!inStream.is_open())
+            break;
+
+        std::string range;
+        while(std::getline(inStream, range, ','))
+        {
+            std::istringstream rangeStream(range);
+            int first, last;
+            char dash;
+            if(!(rangeStream >> first))
+                continue;
+            if(!(rangeStream >> dash >> last))
+                last = first;
+            for(int cpu=first; cpu<=last && cpu<nCpus; cpu++)
+                nodes[cpu] = node;
+        }
+    }
+    return nodes;
+}
+//------------------------------------------------------------------------------
+int mg::numaNodeCount()
+{
+    std::vector<int> nodes = cpuNodes();
+    return *std::max_element(nodes.begin(), nodes.end()) + 1;
+}
+//------------------------------------------------------------------------------
+int mg::currentNode()
+{
+#ifdef __linux__
+    static const std::vector<int> nodes = cpuNodes();
+    int cpu = sched_getcpu();
+    if(cpu >= 0 && cpu < (int)nodes.size())
+        return nodes[cpu];
+#endif
+    return 0;
+}
+//------------------------------------------------------------------------------
+void mg::pinThreads(int nThreads, std::string affinity)
+{
+#ifdef __linux__
+    std::vector<int> nodes = cpuNodes();
+    int nNodes = *std::max_element(nodes.begin(), nodes.end()) + 1;
+
+    // The CPUs the process may use, grouped by node
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    std::vector<std::vector<int>> nodeCpus(nNodes);
+    for(int cpu=0; cpu<(int)nodes.size() && cpu<CPU_SETSIZE; cpu++)
+        if(CPU_ISSET(cpu, &allowed))
+            nodeCpus[nodes[cpu]].push_back(cpu);
+
+    std::vector<int> order;
+    if(affinity == "spread")
+    {
+        size_t maxCpus = 0;
+        for(int node=0; node<nNodes; node++)
+            maxCpus = std::max(maxCpus, nodeCpus[node].size());
+        for(size_t k=0; k<maxCpus; k++)
+            for(int node=0; node<nNodes; node++)
+                if(k < nodeCpus[node].size())
+                    order.push_back(nodeCpus[node][k]);
+    }
+    else
+    {
+        for(int node=0; node<nNodes; node++)
+            order.insert(order.end(), nodeCpus[node].begin(),
+                         nodeCpus[node].end());
+    }
+    if(order.empty())
+        return;
+
+    omp_set_num_threads(nThreads);
+#pragma omp parallel num_threads(nThreads)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(order[omp_get_thread_num() % order.size()], &cpus);
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+
+    std::cout << "Pinned " << nThreads << " threads over " << nNodes
+              << " NUMA nodes (" << affinity << ")" << std::endl;
+#else
+    std::cerr << "Thread pinning is only supported on Linux" << std::endl;
+#endif
+}
+//------------------------------------------------------------------------------
@@ -0,0 +1,68 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * NUMA placement on multi-socket nodes. Linux places a page on the node of
+ * the thread that first writes it, so arrays filled by the main thread all
+ * end up on one socket. The functions here pin the OpenMP threads to the
+ * cores of the NUMA nodes and copy arrays in parallel, so that the pages are
+ * spread over the nodes of the threads using them.
+ */
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <armadillo>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+// The NUMA node of each CPU, all zero when the topology is not available.
+std::vector<int> cpuNodes();
+int numaNodeCount();
+
+// The NUMA node of the CPU the calling thread runs on.
+int currentNode();
+
+// Pins nThreads OpenMP threads to the allowed CPUs. "close" fills one node
+// before the next, "spread" places consecutive threads on different nodes.
+// The OpenMP team size is set to nThreads, so that the pinned threads are
+// the ones running the parallel loops.
+void pinThreads(int nThreads, std::string affinity);
+//------------------------------------------------------------------------------
+// Resizes m to nCols columns, copying the kept columns with a static schedule
+// so that each page is placed on the node of the thread that handles those
+// columns in the parallel loops. New columns are left for the caller to
+// fill.
+//------------------------------------------------------------------------------
+template<class eT>
+void firstTouchResize(arma::Mat<eT> &m, int nCols)
+{
+    arma::Mat<eT> touched(m.n_rows, nCols, arma::fill::none);
+    int nRows = m.n_rows;
+    int nKept = std::min<int>(nCols, m.n_cols);
+
+#pragma omp parallel for schedule(static)
+    for(int j=0; j<nKept; j++)
+        std::copy(m.colptr(j), m.colptr(j) + nRows, touched.colptr(j));
+
+    m.steal_mem(touched);
+}
+//------------------------------------------------------------------------------
+// Replaces m by a copy placed as in firstTouchResize.
+//------------------------------------------------------------------------------
+template<class eT>
+void firstTouch(arma::Mat<eT> &m)
+{
+    firstTouchResize(m, m.n_cols);
+}
+//------------------------------------------------------------------------------
+}
+#endif // NUMA_H
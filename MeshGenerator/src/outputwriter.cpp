@@ -0,0 +1,41 @@
+#include "outputwriter.h"
+
+#include <iostream>
+
+//------------------------------------------------------------------------------
+mg::OutputWriter::~OutputWriter()
+{
+    wait();
+}
+//------------------------------------------------------------------------------
+void mg::OutputWriter::submit(std::function<void()> task)
+{
+    pending.push_back(std::async(std::launch::async, task));
+}
+//------------------------------------------------------------------------------
+void mg::OutputWriter::write(std::string fileName,
+                             std::function<void(std::ostream &)> f)
+{
+    submit([this, fileName, f]() {
+        std::ofstream outStream(fileName.c_str());
+        if(!outStream.is_open())
+        {
+            std::lock_guard<std::mutex> lock(reportMutex);
+            std::cerr << "Unable to open " << fileName << std::endl;
+            return;
+        }
+        f(outStream);
+        outStream.close();
+
+        std::lock_guard<std::mutex> lock(reportMutex);
+        std::cout << fileName << std::endl;
+    });
+}
+//------------------------------------------------------------------------------
+void mg::OutputWriter::wait()
+{
+    for(std::future<void> &task:pending)
+        task.get();
+    pending.clear();
+}
+//------------------------------------------------------------------------------
@@ -0,0 +1,47 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * Common output layer for the post-processing stage. Each output is handed
+ * over as a task that writes one file, and the tasks run concurrently on
+ * background threads while the caller goes on computing. The tasks must
+ * only use data they own, since the generator state may change meanwhile.
+ */
+
+#ifndef OUTPUTWRITER_H
+#define OUTPUTWRITER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+class OutputWriter
+{
+public:
+    ~OutputWriter();
+
+    // Runs a task that writes its own output
+    void submit(std::function<void()> task);
+
+    // Opens the file, lets f fill it and reports it when closed
+    void write(std::string fileName, std::function<void(std::ostream &)> f);
+
+    // Waits for all submitted outputs
+    void wait();
+protected:
+    std::vector<std::future<void>> pending;
+    std::mutex reportMutex;
+};
+//------------------------------------------------------------------------------
+}
+#endif // OUTPUTWRITER_H
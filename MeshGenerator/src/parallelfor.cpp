@@ -0,0 +1,65 @@
+#include "parallelfor.h"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+
+//------------------------------------------------------------------------------
+mg::LoadBalance::LoadBalance():
+    threads(maxThreads())
+{
+}
+//------------------------------------------------------------------------------
+void mg::LoadBalance::beginLoop()
+{
+    if((int)threads.size() < maxThreads())
+        threads.resize(maxThreads());
+    loopStart = std::chrono::steady_clock::now();
+}
+//------------------------------------------------------------------------------
+void mg::LoadBalance::endLoop()
+{
+    std::chrono::duration<double> loop = std::chrono::steady_clock::now()
+            - loopStart;
+    wall += loop.count();
+}
+//------------------------------------------------------------------------------
+void mg::LoadBalance::addBusy(int thread, double seconds)
+{
+    threads[thread].busy += seconds;
+    threads[thread].blocks++;
+}
+//------------------------------------------------------------------------------
+void mg::LoadBalance::write(std::string fileName, std::string name)
+{
+    // A thread is idle for the part of the loop wall time it is not busy.
+    std::ofstream outStream(fileName.c_str());
+    outStream << "# thread\tblocks\tbusy [s]\tidle [s]" << std::endl;
+
+    double maxBusy = 0;
+    double sumBusy = 0;
+    for(int t=0; t<(int)threads.size(); t++)
+    {
+        const ThreadTime &tt = threads[t];
+        outStream << t << "\t" << tt.blocks << "\t" << tt.busy << "\t"
+                  << wall - tt.busy << std::endl;
+        maxBusy = std::max(maxBusy, tt.busy);
+        sumBusy += tt.busy;
+    }
+    outStream.close();
+
+    double meanBusy = sumBusy/threads.size();
+    std::cout << name << ": wall " << wall << " s, mean busy " << meanBusy
+              << " s, max/mean busy "
+              << (meanBusy > 0 ? maxBusy/meanBusy : 0) << std::endl;
+}
+//------------------------------------------------------------------------------
+int mg::maxThreads()
+{
+#ifdef MG_USE_TBB
+    return tbb::this_task_arena::max_concurrency();
+#else
+    return omp_get_max_threads();
+#endif
+}
+//------------------------------------------------------------------------------
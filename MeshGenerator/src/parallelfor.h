@@ -0,0 +1,103 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * Block based parallel loops with dynamic load balancing. Blocks are handed
+ * out to idle threads by OpenMP dynamic scheduling, or by the work-stealing
+ * TBB scheduler when built with CONFIG+=tbb. The LoadBalance class records
+ * the busy and idle time of each thread.
+ */
+
+#ifndef PARALLELFOR_H
+#define PARALLELFOR_H
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <omp.h>
+
+#ifdef MG_USE_TBB
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+#endif
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+class LoadBalance
+{
+public:
+    LoadBalance();
+    void beginLoop();
+    void endLoop();
+    void addBusy(int thread, double seconds);
+    void write(std::string fileName, std::string name);
+protected:
+    // Each thread owns a cache line to avoid false sharing
+    struct alignas(64) ThreadTime
+    {
+        double busy = 0;
+        long blocks = 0;
+    };
+    std::vector<ThreadTime> threads;
+    double wall = 0;
+    std::chrono::steady_clock::time_point loopStart;
+};
+//------------------------------------------------------------------------------
+int maxThreads();
+//------------------------------------------------------------------------------
+// Calls f(blockBegin, blockEnd, thread) for blocks of at most blockSize
+// indices in [begin, end).
+//------------------------------------------------------------------------------
+template<class F>
+void parallelFor(int begin, int end, int blockSize, F f,
+                 LoadBalance *loadBalance = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    blockSize = std::max(blockSize, 1);
+
+    auto runBlock = [&](int i_0, int i_1, int thread) {
+        if(!loadBalance)
+        {
+            f(i_0, i_1, thread);
+            return;
+        }
+        clock::time_point t_0 = clock::now();
+        f(i_0, i_1, thread);
+        std::chrono::duration<double> busy = clock::now() - t_0;
+        loadBalance->addBusy(thread, busy.count());
+    };
+
+    if(loadBalance)
+        loadBalance->beginLoop();
+
+#ifdef MG_USE_TBB
+    tbb::parallel_for(tbb::blocked_range<int>(begin, end, blockSize),
+                      [&](const tbb::blocked_range<int> &r) {
+        runBlock(r.begin(), r.end(),
+                 tbb::this_task_arena::current_thread_index());
+    }, tbb::simple_partitioner());
+#else
+    int nBlocks = (end - begin + blockSize - 1)/blockSize;
+#pragma omp parallel for schedule(dynamic, 1)
+    for(int b=0; b<nBlocks; b++)
+    {
+        int i_0 = begin + b*blockSize;
+        int i_1 = std::min(end, i_0 + blockSize);
+        runBlock(i_0, i_1, omp_get_thread_num());
+    }
+#endif
+
+    if(loadBalance)
+        loadBalance->endLoop();
+}
+//------------------------------------------------------------------------------
+}
+#endif // PARALLELFOR_H
@@ -0,0 +1,196 @@
+#include "poissondisk.h"
+
+#include <cmath>
+
+//------------------------------------------------------------------------------
+mg::PoissonDiskSampler::PoissonDiskSampler(const arma::uchar_mat &mask,
+                                           double X_0, double X_1,
+                                           double Y_0, double Y_1,
+                                           bool periodic_x, bool periodic_y):
+    mask(mask),
+    X_0(X_0), X_1(X_1), Y_0(Y_0), Y_1(Y_1),
+    periodic_x(periodic_x),
+    periodic_y(periodic_y)
+{
+    h = mask.n_rows;
+    w = mask.n_cols;
+    dx = (X_1 - X_0)/w;
+    dy = (Y_1 - Y_0)/h;
+}
+//------------------------------------------------------------------------------
+double mg::PoissonDiskSampler::radiusForCount(int n) const
+{
+    long porePixels = 0;
+    for(int j=0; j<w; j++)
+        for(int i=0; i<h; i++)
+            if(mask(i, j) == 0)
+                porePixels++;
+
+    // A maximal Poisson-disk set has about 0.65/r^2 points per unit area,
+    // the radius is chosen slightly smaller so that the surplus can be
+    // removed at random.
+    double poreArea = porePixels*dx*dy;
+    return sqrt(0.62*poreArea/std::max(n, 1));
+}
+//------------------------------------------------------------------------------
+arma::mat mg::PoissonDiskSampler::sample(double radius, unsigned seed,
+                                         int nCandidates)
+{
+    this->radius = radius;
+    // The cells divide the domain evenly and are at most r/sqrt(2) wide
+    nx = std::max(1, int(ceil((X_1 - X_0)*sqrt(2.0)/radius)));
+    ny = std::max(1, int(ceil((Y_1 - Y_0)*sqrt(2.0)/radius)));
+    cellSize_x = (X_1 - X_0)/nx;
+    cellSize_y = (Y_1 - Y_0)/ny;
+    cells.assign(nx*ny, -1);
+    points.clear();
+    active.clear();
+
+    std::default_random_engine generator(seed);
+    std::uniform_real_distribution<double> distribution_unit(0, 1);
+
+    // Sweeping the background grid for pore space not yet covered, which
+    // also seeds pores that are not connected to the others
+    for(int c_x=0; c_x<nx; c_x++)
+    {
+        for(int c_y=0; c_y<ny; c_y++)
+        {
+            if(cells[c_y + ny*c_x] >= 0)
+                continue;
+            for(int attempt=0; attempt<4; attempt++)
+            {
+                double u = distribution_unit(generator);
+                double v = distribution_unit(generator);
+                double r_x = X_0 + (c_x + u)*cellSize_x;
+                double r_y = Y_0 + (c_y + v)*cellSize_y;
+                if(r_x < X_1 && r_y < Y_1 && tryPoint(r_x, r_y))
+                {
+                    drain(generator, nCandidates);
+                    break;
+                }
+            }
+        }
+    }
+
+    arma::mat x(2, points.size());
+    for(int k=0; k<(int)points.size(); k++)
+    {
+        x(0, k) = points[k][0];
+        x(1, k) = points[k][1];
+    }
+    return x;
+}
+//------------------------------------------------------------------------------
+void mg::PoissonDiskSampler::drain(std::default_random_engine &generator,
+                                   int nCandidates)
+{
+    std::uniform_real_distribution<double> distribution_unit(0, 1);
+
+    while(!active.empty())
+    {
+        // Trying candidates around a random active point
+        std::uniform_int_distribution<int>
+                distribution_active(0, active.size() - 1);
+        int a = distribution_active(generator);
+        const std::array<double, 2> r_a = points[active[a]];
+
+        bool found = false;
+        for(int c=0; c<nCandidates && !found; c++)
+        {
+            double angle = 2*M_PI*distribution_unit(generator);
+            double distance = radius*(1 + distribution_unit(generator));
+            found = tryPoint(r_a[0] + distance*cos(angle),
+                             r_a[1] + distance*sin(angle));
+        }
+
+        if(!found)
+        {
+            active[a] = active.back();
+            active.pop_back();
+        }
+    }
+}
+//------------------------------------------------------------------------------
+bool mg::PoissonDiskSampler::tryPoint(double r_x, double r_y)
+{
+    if(!wrap(r_x, r_y) || isSolid(r_x, r_y))
+        return false;
+
+    int c_x = std::min(nx - 1, int((r_x - X_0)/cellSize_x));
+    int c_y = std::min(ny - 1, int((r_y - Y_0)/cellSize_y));
+    double DX = X_1 - X_0;
+    double DY = Y_1 - Y_0;
+
+    // Points closer than r are at most r/cellSize cells away. The cells are
+    // at most r/sqrt(2) wide, but may be much narrower in a short direction.
+    int range_x = int(ceil(radius/cellSize_x));
+    int range_y = int(ceil(radius/cellSize_y));
+    for(int i=c_x-range_x; i<=c_x+range_x; i++)
+    {
+        int g_x = i;
+        if(g_x < 0 || g_x >= nx)
+        {
+            if(!periodic_x)
+                continue;
+            g_x = (g_x + nx)%nx;
+        }
+        for(int j=c_y-range_y; j<=c_y+range_y; j++)
+        {
+            int g_y = j;
+            if(g_y < 0 || g_y >= ny)
+            {
+                if(!periodic_y)
+                    continue;
+                g_y = (g_y + ny)%ny;
+            }
+
+            int k = cells[g_y + ny*g_x];
+            if(k < 0)
+                continue;
+
+            double d_x = r_x - points[k][0];
+            double d_y = r_y - points[k][1];
+            if(periodic_x)
+                d_x -= DX*round(d_x/DX);
+            if(periodic_y)
+                d_y -= DY*round(d_y/DY);
+            if(d_x*d_x + d_y*d_y < radius*radius)
+                return false;
+        }
+    }
+
+    cells[c_y + ny*c_x] = points.size();
+    active.push_back(points.size());
+    points.push_back({{r_x, r_y}});
+    return true;
+}
+//------------------------------------------------------------------------------
+bool mg::PoissonDiskSampler::wrap(double &r_x, double &r_y) const
+{
+    // Candidates outside the domain are wrapped in periodic directions and
+    // rejected otherwise
+    double DX = X_1 - X_0;
+    double DY = Y_1 - Y_0;
+    if(r_x < X_0 || r_x >= X_1)
+    {
+        if(!periodic_x)
+            return false;
+        r_x -= DX*floor((r_x - X_0)/DX);
+    }
+    if(r_y < Y_0 || r_y >= Y_1)
+    {
+        if(!periodic_y)
+            return false;
+        r_y -= DY*floor((r_y - Y_0)/DY);
+    }
+    return true;
+}
+//------------------------------------------------------------------------------
+bool mg::PoissonDiskSampler::isSolid(double r_x, double r_y) const
+{
+    // The same pixel lookup as MeshGenerator::isSolid
+    int i = std::max(0, std::min(int(r_y/dy), h - 1));
+    int j = std::max(0, std::min(int(r_x/dx), w - 1));
+    return mask(i, j) > 0;
+}
+//------------------------------------------------------------------------------
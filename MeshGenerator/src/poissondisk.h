@@ -0,0 +1,65 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * Poisson-disk sampling of the pore space with Bridson's algorithm. New
+ * points are tried in the annulus between r and 2r around active points and
+ * accepted when they are in the pore space and no other point is closer
+ * than r. Pore regions not reached from the first seed are seeded by a sweep
+ * over the background grid. The result is a well spaced set of generators
+ * in a single pass, which a few CVT iterations can then regularise.
+ */
+
+#ifndef POISSONDISK_H
+#define POISSONDISK_H
+
+#include <armadillo>
+#include <vector>
+#include <array>
+#include <random>
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+class PoissonDiskSampler
+{
+public:
+    PoissonDiskSampler(const arma::uchar_mat &mask, double X_0, double X_1,
+                       double Y_0, double Y_1, bool periodic_x,
+                       bool periodic_y);
+
+    // The radius giving slightly more than n points in the pore space
+    double radiusForCount(int n) const;
+
+    arma::mat sample(double radius, unsigned seed, int nCandidates = 30);
+protected:
+    const arma::uchar_mat &mask;
+    int w;
+    int h;
+    double X_0, X_1, Y_0, Y_1;
+    double dx, dy;
+    bool periodic_x;
+    bool periodic_y;
+
+    // Background grid with at most one point per cell
+    double radius;
+    double cellSize_x;
+    double cellSize_y;
+    int nx;
+    int ny;
+    std::vector<int> cells;
+    std::vector<std::array<double, 2>> points;
+    std::vector<int> active;
+
+    bool isSolid(double r_x, double r_y) const;
+    bool wrap(double &r_x, double &r_y) const;
+    bool tryPoint(double r_x, double r_y);
+    void drain(std::default_random_engine &generator, int nCandidates);
+};
+//------------------------------------------------------------------------------
+}
+#endif // POISSONDISK_H
@@ -0,0 +1,97 @@
+#include "polygon.h"
+
+#include <cmath>
+
+//------------------------------------------------------------------------------
+void mg::clipHalfPlane(Polygon &polygon, double a, double b, double c)
+{
+    // Sutherland-Hodgman for a single edge
+    int m = polygon.size();
+    if(m == 0)
+        return;
+
+    Polygon clipped;
+    clipped.reserve(m + 1);
+    for(int k=0; k<m; k++)
+    {
+        const std::array<double, 2> &p = polygon[k];
+        const std::array<double, 2> &q = polygon[(k + 1)%m];
+        double s_p = a*p[0] + b*p[1] - c;
+        double s_q = a*q[0] + b*q[1] - c;
+
+        if(s_p <= 0)
+            clipped.push_back(p);
+        if((s_p < 0 && s_q > 0) || (s_p > 0 && s_q < 0))
+        {
+            double t = s_p/(s_p - s_q);
+            clipped.push_back({{p[0] + t*(q[0] - p[0]),
+                                p[1] + t*(q[1] - p[1])}});
+        }
+    }
+    polygon.swap(clipped);
+}
+//------------------------------------------------------------------------------
+double mg::polygonArea(const Polygon &polygon)
+{
+    double area = 0;
+    int m = polygon.size();
+    for(int k=0; k<m; k++)
+    {
+        const std::array<double, 2> &p = polygon[k];
+        const std::array<double, 2> &q = polygon[(k + 1)%m];
+        area += p[0]*q[1] - q[0]*p[1];
+    }
+    return 0.5*area;
+}
+//------------------------------------------------------------------------------
+double mg::clippedArea(const Polygon &subject, const Polygon &convex)
+{
+    // Clipping against each edge of the convex polygon. For a non-convex
+    // subject the result may contain degenerate edges along the clip
+    // boundary, which do not change the signed area.
+    Polygon clipped = subject;
+    int m = convex.size();
+    for(int k=0; k<m && !clipped.empty(); k++)
+    {
+        const std::array<double, 2> &p = convex[k];
+        const std::array<double, 2> &q = convex[(k + 1)%m];
+        double a = q[1] - p[1];
+        double b = p[0] - q[0];
+        clipHalfPlane(clipped, a, b, a*p[0] + b*p[1]);
+    }
+    return polygonArea(clipped);
+}
+//------------------------------------------------------------------------------
+bool mg::insideConvex(const Polygon &convex, double x, double y)
+{
+    int m = convex.size();
+    for(int k=0; k<m; k++)
+    {
+        const std::array<double, 2> &p = convex[k];
+        const std::array<double, 2> &q = convex[(k + 1)%m];
+        if((q[0] - p[0])*(y - p[1]) - (q[1] - p[1])*(x - p[0]) < 0)
+            return false;
+    }
+    return true;
+}
+//------------------------------------------------------------------------------
+void mg::marchingSquaresPiece(const bool pore[4], double x0, double y0,
+                              double dx, double dy, Polygon &piece)
+{
+    const double corners[4][2] = {{x0, y0}, {x0 + dx, y0},
+                                  {x0 + dx, y0 + dy}, {x0, y0 + dy}};
+
+    // Walking the corners, adding pore corners and the midpoints of edges
+    // between pore and solid corners
+    piece.clear();
+    for(int k=0; k<4; k++)
+    {
+        int l = (k + 1)%4;
+        if(pore[k])
+            piece.push_back({{corners[k][0], corners[k][1]}});
+        if(pore[k] != pore[l])
+            piece.push_back({{0.5*(corners[k][0] + corners[l][0]),
+                              0.5*(corners[k][1] + corners[l][1])}});
+    }
+}
+//------------------------------------------------------------------------------
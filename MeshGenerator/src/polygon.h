@@ -0,0 +1,42 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * Small polygon routines for the exact Voronoi volumes: clipping against
+ * half-planes and convex polygons, and the pore part of a marching squares
+ * cell. Polygons are stored counter-clockwise.
+ */
+
+#ifndef POLYGON_H
+#define POLYGON_H
+
+#include <vector>
+#include <array>
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+typedef std::vector<std::array<double, 2>> Polygon;
+//------------------------------------------------------------------------------
+// Keeps the part of the polygon where a*x + b*y <= c.
+void clipHalfPlane(Polygon &polygon, double a, double b, double c);
+
+double polygonArea(const Polygon &polygon);
+
+// Area of the intersection of any simple polygon with a convex polygon.
+double clippedArea(const Polygon &subject, const Polygon &convex);
+
+bool insideConvex(const Polygon &convex, double x, double y);
+
+// The pore part of a marching squares cell with lower left corner (x0, y0),
+// the corners are given counter-clockwise from the lower left. The two
+// saddle cases are resolved as connected pore space.
+void marchingSquaresPiece(const bool pore[4], double x0, double y0,
+                          double dx, double dy, Polygon &piece);
+//------------------------------------------------------------------------------
+}
+#endif // POLYGON_H
@@ -0,0 +1,405 @@
+#include "remeshgenerator.h"
+#include "imagereader.h"
+
+#include <deque>
+
+//------------------------------------------------------------------------------
+mg::RemeshGenerator::RemeshGenerator(mg::Parameters parameters):
+    param(parameters)
+{
+    ImageReader reader(param.imgPath, param.cacheMask);
+    img_data = reader.readMask();
+    h = img_data.n_rows;
+    w = img_data.n_cols;
+
+    // The domain spans [0, 1] in x, as for MeshGenerator without boundaries
+    pix = 1.0/w;
+
+    if(param.setBoundaries || param.periodic_x || param.periodic_y)
+        std::cerr << "Boundaries and periodic boundaries are ignored when "
+                  << "remeshing" << std::endl;
+}
+//------------------------------------------------------------------------------
+void mg::RemeshGenerator::setPreviousMesh(const arma::mat &x_previous,
+                                          const arma::vec &js_previous,
+                                          const arma::uchar_mat &previousMask,
+                                          const arma::vec &volumes_previous)
+{
+    if(previousMask.n_rows != img_data.n_rows ||
+            previousMask.n_cols != img_data.n_cols)
+    {
+        std::cerr << "The previous image has a different size" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    this->previousMask = previousMask;
+
+    int n = x_previous.n_cols;
+    positions.resize(n);
+    js.resize(n);
+    volumes.assign(n, 0);
+    alive.assign(n, true);
+    hasVolumes = (int)volumes_previous.n_elem == n;
+    for(int i=0; i<n; i++)
+    {
+        positions[i] = {{x_previous(0, i), x_previous(1, i)}};
+        js[i] = i < (int)js_previous.n_elem ? js_previous(i) : 1;
+        if(hasVolumes)
+            volumes[i] = volumes_previous(i);
+    }
+}
+//------------------------------------------------------------------------------
+void mg::RemeshGenerator::readPreviousMesh(string xyzPath,
+                                           string iterationCountsPath,
+                                           string previousImgPath)
+{
+    ifstream inStream(xyzPath.c_str());
+    if(!inStream.is_open())
+    {
+        std::cerr << "Could not open " << xyzPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    int n;
+    string line;
+    inStream >> n;
+    std::getline(inStream, line);
+    std::getline(inStream, line);
+
+    arma::mat x_previous(2, n);
+    arma::vec volumes_previous(n);
+    for(int i=0; i<n; i++)
+    {
+        int id;
+        double z;
+        inStream >> id >> x_previous(0, i) >> x_previous(1, i) >> z
+                 >> volumes_previous(i);
+    }
+
+    arma::vec js_previous;
+    if(!iterationCountsPath.empty())
+        js_previous.load(iterationCountsPath, arma::raw_ascii);
+
+    ImageReader reader(previousImgPath, param.cacheMask);
+    setPreviousMesh(x_previous, js_previous, reader.readMask(),
+                    volumes_previous);
+}
+//------------------------------------------------------------------------------
+arma::mat mg::RemeshGenerator::remesh()
+{
+    long porePrevious = 0;
+    for(int j=0; j<w; j++)
+        for(int i=0; i<h; i++)
+            if(previousMask(i, j) == 0)
+                porePrevious++;
+
+    if(positions.empty() || porePrevious == 0)
+    {
+        std::cerr << "The previous mesh is empty" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // The blocks are remeshBuffer generator spacings wide, so that the
+    // generators around a changed block are well inside the next blocks.
+    particlesPerPixel = double(positions.size())/porePrevious;
+    double spacing = 1.0/sqrt(particlesPerPixel);
+    blockSize = std::max(1, int(ceil(param.remeshBuffer*spacing)));
+    nbx = (w + blockSize - 1)/blockSize;
+    nby = (h + blockSize - 1)/blockSize;
+
+    std::vector<std::vector<int>> regions = affectedRegions();
+    std::cout << "Remeshing " << regions.size() << " changed regions"
+              << std::endl;
+    for(const std::vector<int> &blocks:regions)
+        remeshRegion(blocks);
+
+    int n = std::count(alive.begin(), alive.end(), true);
+    arma::mat x(2, n);
+    int k = 0;
+    for(size_t i=0; i<positions.size(); i++)
+    {
+        if(!alive[i])
+            continue;
+        x(0, k) = positions[i][0];
+        x(1, k) = positions[i][1];
+        k++;
+    }
+
+    return x;
+}
+//------------------------------------------------------------------------------
+arma::vec mg::RemeshGenerator::getIterationCounts() const
+{
+    int n = std::count(alive.begin(), alive.end(), true);
+    arma::vec counts(n);
+    int k = 0;
+    for(size_t i=0; i<js.size(); i++)
+        if(alive[i])
+            counts(k++) = js[i];
+    return counts;
+}
+//------------------------------------------------------------------------------
+arma::vec mg::RemeshGenerator::getVolumes() const
+{
+    if(!hasVolumes)
+        return arma::vec();
+
+    int n = std::count(alive.begin(), alive.end(), true);
+    arma::vec v(n);
+    int k = 0;
+    for(size_t i=0; i<volumes.size(); i++)
+        if(alive[i])
+            v(k++) = volumes[i];
+    return v;
+}
+//------------------------------------------------------------------------------
+const arma::uchar_mat &mg::RemeshGenerator::getMask() const
+{
+    return img_data;
+}
+//------------------------------------------------------------------------------
+int mg::RemeshGenerator::blockOf(double r_x, double r_y) const
+{
+    int j = std::max(0, std::min(int(r_x/pix), w - 1));
+    int i = std::max(0, std::min(int(r_y/pix), h - 1));
+    return j/blockSize + nbx*(i/blockSize);
+}
+//------------------------------------------------------------------------------
+std::vector<std::vector<int>> mg::RemeshGenerator::affectedRegions()
+{
+    // Blocks where the mask changed, extended by one block
+    std::vector<bool> changed(nbx*nby, false);
+    for(int j=0; j<w; j++)
+        for(int i=0; i<h; i++)
+            if(img_data(i, j) != previousMask(i, j))
+                changed[j/blockSize + nbx*(i/blockSize)] = true;
+
+    std::vector<bool> affected(nbx*nby, false);
+    for(int by=0; by<nby; by++)
+    {
+        for(int bx=0; bx<nbx; bx++)
+        {
+            if(!changed[bx + nbx*by])
+                continue;
+            for(int y=std::max(0, by-1); y<=std::min(nby-1, by+1); y++)
+                for(int x=std::max(0, bx-1); x<=std::min(nbx-1, bx+1); x++)
+                    affected[x + nbx*y] = true;
+        }
+    }
+
+    // Connected regions of affected blocks are converged separately
+    std::vector<std::vector<int>> regions;
+    std::vector<bool> visited(nbx*nby, false);
+    for(int b=0; b<nbx*nby; b++)
+    {
+        if(!affected[b] || visited[b])
+            continue;
+
+        std::vector<int> blocks;
+        std::deque<int> queue = {b};
+        visited[b] = true;
+        while(!queue.empty())
+        {
+            int c = queue.front();
+            queue.pop_front();
+            blocks.push_back(c);
+
+            int bx = c%nbx;
+            int by = c/nbx;
+            for(int y=std::max(0, by-1); y<=std::min(nby-1, by+1); y++)
+            {
+                for(int x=std::max(0, bx-1); x<=std::min(nbx-1, bx+1); x++)
+                {
+                    int neighbour = x + nbx*y;
+                    if(affected[neighbour] && !visited[neighbour])
+                    {
+                        visited[neighbour] = true;
+                        queue.push_back(neighbour);
+                    }
+                }
+            }
+        }
+        regions.push_back(blocks);
+    }
+
+    return regions;
+}
+//------------------------------------------------------------------------------
+void mg::RemeshGenerator::remeshRegion(const std::vector<int> &blocks)
+{
+    std::vector<bool> inRegion(nbx*nby, false);
+    int bx0 = nbx, bx1 = 0, by0 = nby, by1 = 0;
+    for(int b:blocks)
+    {
+        inRegion[b] = true;
+        bx0 = std::min(bx0, b%nbx);
+        bx1 = std::max(bx1, b%nbx);
+        by0 = std::min(by0, b/nbx);
+        by1 = std::max(by1, b/nbx);
+    }
+
+    // The converged region includes one block of fixed generators around
+    // the affected blocks, in pixels
+    int ex0 = std::max(0, (bx0 - 1)*blockSize);
+    int ey0 = std::max(0, (by0 - 1)*blockSize);
+    int ex1 = std::min(w, (bx1 + 2)*blockSize);
+    int ey1 = std::min(h, (by1 + 2)*blockSize);
+    int ew = ex1 - ex0;
+    int eh = ey1 - ey0;
+
+    // Pore pixels of the affected blocks, and those that were solid before
+    std::vector<int> pore;
+    std::vector<int> opened;
+    for(int b:blocks)
+    {
+        int x0 = (b%nbx)*blockSize;
+        int y0 = (b/nbx)*blockSize;
+        for(int j=x0; j<std::min(w, x0 + blockSize); j++)
+        {
+            for(int i=y0; i<std::min(h, y0 + blockSize); i++)
+            {
+                if(img_data(i, j) > 0)
+                    continue;
+                pore.push_back(i + h*j);
+                if(previousMask(i, j) > 0)
+                    opened.push_back(i + h*j);
+            }
+        }
+    }
+
+    // Keeping the generators that are still in the pore space
+    std::vector<int> free;
+    for(size_t i=0; i<positions.size(); i++)
+    {
+        if(!alive[i] || !inRegion[blockOf(positions[i][0], positions[i][1])])
+            continue;
+        int px = std::max(0, std::min(int(positions[i][0]/pix), w - 1));
+        int py = std::max(0, std::min(int(positions[i][1]/pix), h - 1));
+        if(img_data(py, px) > 0)
+            alive[i] = false;
+        else
+            free.push_back(i);
+    }
+
+    // Removing or inserting generators to keep the density per pore pixel,
+    // new generators are placed in the pore space that opened up first
+    std::default_random_engine generator(
+                std::chrono::system_clock::now().time_since_epoch().count());
+    std::uniform_real_distribution<double> distribution_offset(0, 1);
+    int nTarget = round(particlesPerPixel*pore.size());
+
+    std::shuffle(free.begin(), free.end(), generator);
+    while((int)free.size() > nTarget)
+    {
+        alive[free.back()] = false;
+        free.pop_back();
+    }
+
+    const std::vector<int> &candidates = opened.empty() ? pore : opened;
+    if(!candidates.empty())
+    {
+        std::uniform_int_distribution<int>
+                distribution_pixel(0, candidates.size() - 1);
+        while((int)free.size() < nTarget)
+        {
+            int p = candidates[distribution_pixel(generator)];
+            positions.push_back({{(p/h + distribution_offset(generator))*pix,
+                                  (p%h + distribution_offset(generator))*pix}});
+            js.push_back(1);
+            volumes.push_back(0);
+            alive.push_back(true);
+            free.push_back(positions.size() - 1);
+        }
+    }
+
+    int nFree = free.size();
+    if(nFree == 0)
+        return;
+
+    // Free generators and the fixed generators around them, in local
+    // coordinates
+    arma::mat x_free(2, nFree);
+    arma::vec js_free(nFree);
+    for(int k=0; k<nFree; k++)
+    {
+        x_free(0, k) = positions[free[k]][0] - ex0*pix;
+        x_free(1, k) = positions[free[k]][1] - ey0*pix;
+        js_free(k) = js[free[k]];
+    }
+
+    std::vector<int> fixed;
+    for(size_t i=0; i<positions.size(); i++)
+    {
+        if(!alive[i] || inRegion[blockOf(positions[i][0], positions[i][1])])
+            continue;
+        double lx = positions[i][0] - ex0*pix;
+        double ly = positions[i][1] - ey0*pix;
+        if(lx >= 0 && lx < ew*pix && ly >= 0 && ly < eh*pix)
+            fixed.push_back(i);
+    }
+    arma::mat x_fixed(2, fixed.size());
+    for(int k=0; k<(int)fixed.size(); k++)
+    {
+        x_fixed(0, k) = positions[fixed[k]][0] - ex0*pix;
+        x_fixed(1, k) = positions[fixed[k]][1] - ey0*pix;
+    }
+
+    arma::uchar_mat region(eh, ew);
+    for(int j=0; j<ew; j++)
+        for(int i=0; i<eh; i++)
+            region(i, j) = img_data(ey0 + i, ex0 + j);
+
+    // Converging the region with the same number of samples per generator,
+    // the fixed generators take samples as well. The generators are written
+    // back by their index, so they must not be reordered.
+    Parameters regionParam = param;
+    regionParam.setBoundaries = true;
+    regionParam.X_0 = 0;
+    regionParam.X_1 = ew*pix;
+    regionParam.Y_0 = 0;
+    regionParam.Y_1 = eh*pix;
+    regionParam.nParticles = nFree + x_fixed.n_cols;
+    double samplesPerGenerator = double(param.q)/param.nParticles;
+    regionParam.q = std::max(1, int(round(regionParam.nParticles*
+                                          samplesPerGenerator)));
+    regionParam.hilbertOrder = false;
+    regionParam.periodic_x = false;
+    regionParam.periodic_y = false;
+    regionParam.testingSave = false;
+    regionParam.saveImage = false;
+    regionParam.imageResolution = w;
+
+    MeshGenerator regionGenerator(regionParam, region);
+    region.reset();
+    regionGenerator.setGenerators(x_free, x_fixed, js_free);
+    arma::mat x = regionGenerator.createMesh();
+    arma::vec js_region = regionGenerator.getIterationCounts();
+
+    for(int k=0; k<nFree; k++)
+    {
+        positions[free[k]] = {{x(0, k) + ex0*pix, x(1, k) + ey0*pix}};
+        js[free[k]] = js_region(k);
+    }
+    if(!hasVolumes)
+        return;
+
+    // Only the cells of the free generators and of the fixed generators
+    // within half a block of the affected blocks have changed. Cells further
+    // out may be cut by the edge of the converged region and are kept.
+    arma::vec volumes_region = regionGenerator.calculateVolumes();
+    for(int k=0; k<nFree; k++)
+        volumes[free[k]] = volumes_region(k);
+
+    double reach = 0.5*blockSize*pix;
+    for(int k=0; k<(int)fixed.size(); k++)
+    {
+        const std::array<double, 2> &r = positions[fixed[k]];
+        bool nearRegion = false;
+        for(int s_x=-1; s_x<=1; s_x+=2)
+            for(int s_y=-1; s_y<=1; s_y+=2)
+                if(inRegion[blockOf(r[0] + s_x*reach, r[1] + s_y*reach)])
+                    nearRegion = true;
+        if(nearRegion)
+            volumes[fixed[k]] = volumes_region(nFree + k);
+    }
+}
+//------------------------------------------------------------------------------
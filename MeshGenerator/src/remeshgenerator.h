@@ -0,0 +1,82 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * The RemeshGenerator class updates an existing mesh after the image has
+ * changed, e.g. between steps of a dissolution or precipitation simulation.
+ * The old and new masks are compared in blocks a few generator spacings
+ * wide. Generators are removed from and inserted into the changed blocks so
+ * that the generator density per pore area is kept, and only the changed
+ * blocks and their neighbours are converged again, with the surrounding
+ * generators kept fixed.
+ */
+
+#ifndef REMESHGENERATOR_H
+#define REMESHGENERATOR_H
+
+#include <armadillo>
+#include <vector>
+#include <array>
+
+#include "meshgenerator.h"
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+class RemeshGenerator
+{
+public:
+    RemeshGenerator(Parameters parameters);
+
+    // The previous mesh in the coordinates of MeshGenerator without
+    // boundaries, with the iteration counts and, when given, the volumes of
+    // the generators.
+    void setPreviousMesh(const arma::mat &x_previous,
+                         const arma::vec &js_previous,
+                         const arma::uchar_mat &previousMask,
+                         const arma::vec &volumes_previous = arma::vec());
+
+    // Reads the previous mesh from an xyz file written by save_image_and_xyz
+    // and the iteration counts, when given, from a raw ascii file.
+    void readPreviousMesh(string xyzPath, string iterationCountsPath,
+                          string previousImgPath);
+
+    arma::mat remesh();
+    arma::vec getIterationCounts() const;
+
+    // The volumes of the previous mesh with those around the changed blocks
+    // recomputed, empty when the previous volumes were not given.
+    arma::vec getVolumes() const;
+    const arma::uchar_mat &getMask() const;
+protected:
+    Parameters param;
+    arma::uchar_mat img_data;
+    arma::uchar_mat previousMask;
+    int w;
+    int h;
+    double pix;
+
+    // All generators, removed generators are marked as not alive
+    std::vector<std::array<double, 2>> positions;
+    std::vector<double> js;
+    std::vector<double> volumes;
+    std::vector<bool> alive;
+    bool hasVolumes = false;
+
+    // Blocks of blockSize x blockSize pixels
+    int blockSize;
+    int nbx;
+    int nby;
+    double particlesPerPixel;
+
+    int blockOf(double r_x, double r_y) const;
+    std::vector<std::vector<int>> affectedRegions();
+    void remeshRegion(const std::vector<int> &blocks);
+};
+//------------------------------------------------------------------------------
+}
+#endif // REMESHGENERATOR_H
@@ -0,0 +1,250 @@
+#include "snapshotstream.h"
+
+#include <zlib.h>
+#include <cstring>
+
+namespace
+{
+const char snapshotMagic[8] = {'M', 'G', 'S', 'N', 'A', 'P', '0', '1'};
+const char indexMagic[8] = {'M', 'G', 'S', 'I', 'D', 'X', '0', '1'};
+
+struct SnapshotFooter
+{
+    uint64_t nFrames;
+    uint64_t indexOffset;
+    char magic[8];
+};
+}
+
+//------------------------------------------------------------------------------
+mg::SnapshotWriter::SnapshotWriter(string fileName, int keyframeInterval):
+    keyframeInterval(keyframeInterval > 0 ? keyframeInterval : 1)
+{
+    outStream.open(fileName.c_str(), ios::binary);
+    if(!outStream.is_open())
+    {
+        cerr << "Could not open " << fileName << endl;
+        exit(EXIT_FAILURE);
+    }
+    outStream.write(snapshotMagic, sizeof(snapshotMagic));
+
+    worker = std::thread(&SnapshotWriter::run, this);
+}
+//------------------------------------------------------------------------------
+mg::SnapshotWriter::~SnapshotWriter()
+{
+    close();
+}
+//------------------------------------------------------------------------------
+void mg::SnapshotWriter::close()
+{
+    if(closed)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    condition.notify_all();
+    worker.join();
+
+    SnapshotFooter footer;
+    footer.nFrames = index.size();
+    footer.indexOffset = outStream.tellp();
+    memcpy(footer.magic, indexMagic, sizeof(indexMagic));
+
+    outStream.write((const char*) index.data(),
+                    index.size()*sizeof(SnapshotIndexEntry));
+    outStream.write((const char*) &footer, sizeof(footer));
+    outStream.close();
+    closed = true;
+}
+//------------------------------------------------------------------------------
+void mg::SnapshotWriter::run()
+{
+    while(true)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return pending || stop; });
+        if(!pending)
+            break;
+
+        std::swap(front, back);
+        frontIteration = backIteration;
+        pending = false;
+        lock.unlock();
+        condition.notify_all();
+
+        writeFrame();
+    }
+}
+//------------------------------------------------------------------------------
+void mg::SnapshotWriter::writeFrame()
+{
+    int nValues = front.size();
+    bool keyframe = index.size() % keyframeInterval == 0 ||
+            (int) previous.size() != nValues;
+
+    std::vector<uint64_t> bits(nValues);
+    memcpy(bits.data(), front.data(), nValues*sizeof(double));
+
+    // Consecutive frames differ in the low bytes only, the XOR with the
+    // previous frame and the split into byte planes leaves long runs of zeros
+    // for deflate.
+    std::vector<unsigned char> planes(nValues*sizeof(uint64_t));
+    for(int i=0; i<nValues; i++)
+    {
+        uint64_t delta = keyframe ? bits[i] : bits[i] ^ previous[i];
+        for(size_t b=0; b<sizeof(uint64_t); b++)
+            planes[b*nValues + i] = (delta >> 8*b) & 0xff;
+    }
+    previous.swap(bits);
+
+    uLongf compressedSize = compressBound(planes.size());
+    std::vector<unsigned char> compressed(compressedSize);
+    int status = compress2(compressed.data(), &compressedSize, planes.data(),
+                           planes.size(), Z_BEST_SPEED);
+    if(status != Z_OK)
+    {
+        // The frame is dropped and the next one stored as a keyframe, so
+        // that the stream stays readable
+        cerr << "Unable to compress the snapshot of iteration "
+             << frontIteration << " (zlib error " << status << ")" << endl;
+        previous.clear();
+        return;
+    }
+
+    SnapshotIndexEntry entry;
+    entry.iteration = frontIteration;
+    entry.offset = outStream.tellp();
+    entry.keyframe = keyframe;
+    index.push_back(entry);
+
+    SnapshotFrameHeader header;
+    header.iteration = frontIteration;
+    header.nValues = nValues;
+    header.keyframe = keyframe;
+    header.reserved = 0;
+    header.compressedSize = compressedSize;
+
+    outStream.write((const char*) &header, sizeof(header));
+    outStream.write((const char*) compressed.data(), compressedSize);
+}
+//------------------------------------------------------------------------------
+mg::SnapshotReader::SnapshotReader(string fileName)
+{
+    inStream.open(fileName.c_str(), ios::binary);
+    char magic[8];
+    if(!inStream.read(magic, sizeof(magic)) ||
+            memcmp(magic, snapshotMagic, sizeof(magic)) != 0)
+    {
+        cerr << fileName << " is not a snapshot stream" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // A stream without an index, e.g. from an interrupted run, is scanned
+    // frame by frame.
+    SnapshotFooter footer;
+    inStream.seekg(0, ios::end);
+    int64_t fileSize = inStream.tellg();
+    if(fileSize >= (int64_t) (sizeof(snapshotMagic) + sizeof(footer)))
+    {
+        inStream.seekg(fileSize - sizeof(footer));
+        inStream.read((char*) &footer, sizeof(footer));
+        if(memcmp(footer.magic, indexMagic, sizeof(indexMagic)) == 0)
+        {
+            index.resize(footer.nFrames);
+            inStream.seekg(footer.indexOffset);
+            inStream.read((char*) index.data(),
+                          index.size()*sizeof(SnapshotIndexEntry));
+            return;
+        }
+    }
+    inStream.clear();
+    scanFrames();
+}
+//------------------------------------------------------------------------------
+int mg::SnapshotReader::nFrames() const
+{
+    return index.size();
+}
+//------------------------------------------------------------------------------
+int mg::SnapshotReader::iteration(int frame) const
+{
+    return index[frame].iteration;
+}
+//------------------------------------------------------------------------------
+arma::mat mg::SnapshotReader::read(int frame)
+{
+    int first = frame;
+    while(first > 0 && !index[first].keyframe)
+        first--;
+
+    std::vector<uint64_t> bits;
+    for(int f=first; f<=frame; f++)
+        readFrame(index[f], bits);
+
+    arma::mat positions(2, bits.size()/2);
+    memcpy(positions.memptr(), bits.data(), bits.size()*sizeof(double));
+    return positions;
+}
+//------------------------------------------------------------------------------
+void mg::SnapshotReader::scanFrames()
+{
+    inStream.seekg(0, ios::end);
+    uint64_t fileSize = inStream.tellg();
+    uint64_t offset = sizeof(snapshotMagic);
+    SnapshotFrameHeader header;
+    inStream.seekg(offset);
+    while(inStream.read((char*) &header, sizeof(header)))
+    {
+        // The last frame may be incomplete
+        uint64_t next = offset + sizeof(header) + header.compressedSize;
+        if(next > fileSize)
+            break;
+
+        SnapshotIndexEntry entry;
+        entry.iteration = header.iteration;
+        entry.offset = offset;
+        entry.keyframe = header.keyframe;
+        index.push_back(entry);
+
+        offset = next;
+        inStream.seekg(offset);
+    }
+    inStream.clear();
+}
+//------------------------------------------------------------------------------
+void mg::SnapshotReader::readFrame(const SnapshotIndexEntry &entry,
+                                   std::vector<uint64_t> &bits)
+{
+    SnapshotFrameHeader header;
+    inStream.seekg(entry.offset);
+    inStream.read((char*) &header, sizeof(header));
+
+    std::vector<unsigned char> compressed(header.compressedSize);
+    inStream.read((char*) compressed.data(), compressed.size());
+
+    int nValues = header.nValues;
+    std::vector<unsigned char> planes(nValues*sizeof(uint64_t));
+    uLongf size = planes.size();
+    if(uncompress(planes.data(), &size, compressed.data(),
+                  compressed.size()) != Z_OK)
+    {
+        cerr << "Corrupt snapshot frame at iteration " << header.iteration
+             << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if(header.keyframe || (int) bits.size() != nValues)
+        bits.assign(nValues, 0);
+
+    for(int i=0; i<nValues; i++)
+    {
+        uint64_t delta = 0;
+        for(size_t b=0; b<sizeof(uint64_t); b++)
+            delta |= (uint64_t) planes[b*nValues + i] << 8*b;
+        bits[i] ^= delta;
+    }
+}
+//------------------------------------------------------------------------------
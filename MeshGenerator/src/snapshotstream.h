@@ -0,0 +1,124 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * Time series of generator positions in a single compressed file. The
+ * SnapshotWriter copies the positions into a back buffer and returns, a
+ * background thread encodes and appends the frames. Each frame is stored as
+ * the XOR of its bit pattern with the previous frame, split into byte planes
+ * and deflated, with a full keyframe every few frames. An index at the end of
+ * the file gives random access to the frames through the SnapshotReader.
+ */
+
+#ifndef SNAPSHOTSTREAM_H
+#define SNAPSHOTSTREAM_H
+
+#include <armadillo>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+struct SnapshotFrameHeader
+{
+    int32_t iteration;
+    int32_t nValues;
+    uint32_t keyframe;
+    uint32_t reserved;
+    uint64_t compressedSize;
+};
+//------------------------------------------------------------------------------
+struct SnapshotIndexEntry
+{
+    int64_t iteration;
+    uint64_t offset;
+    uint64_t keyframe;
+};
+//------------------------------------------------------------------------------
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(string fileName, int keyframeInterval = 10);
+    ~SnapshotWriter();
+
+    // Copies the first n columns of the (2 x n) positions and returns
+    // without waiting for the frame to be written, unless the previous frame
+    // is still pending.
+    template<class T>
+    void push(int iteration, const T *positions, int n);
+
+    // Writes the remaining frames and the index.
+    void close();
+protected:
+    ofstream outStream;
+    int keyframeInterval;
+    bool closed = false;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool pending = false;
+    bool stop = false;
+
+    std::vector<double> back;
+    std::vector<double> front;
+    int backIteration = 0;
+    int frontIteration = 0;
+
+    std::vector<uint64_t> previous;
+    std::vector<SnapshotIndexEntry> index;
+
+    void run();
+    void writeFrame();
+};
+//------------------------------------------------------------------------------
+class SnapshotReader
+{
+public:
+    SnapshotReader(string fileName);
+
+    int nFrames() const;
+    int iteration(int frame) const;
+
+    // Returns the (2 x n) positions of a frame, decoding from the closest
+    // preceding keyframe.
+    arma::mat read(int frame);
+protected:
+    ifstream inStream;
+    std::vector<SnapshotIndexEntry> index;
+
+    void scanFrames();
+    void readFrame(const SnapshotIndexEntry &entry,
+                   std::vector<uint64_t> &bits);
+};
+//------------------------------------------------------------------------------
+template<class T>
+void SnapshotWriter::push(int iteration, const T *positions, int n)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this] { return !pending; });
+
+    back.resize(2*n);
+    for(int i=0; i<2*n; i++)
+        back[i] = positions[i];
+    backIteration = iteration;
+    pending = true;
+
+    lock.unlock();
+    condition.notify_all();
+}
+//------------------------------------------------------------------------------
+}
+#endif // SNAPSHOTSTREAM_H
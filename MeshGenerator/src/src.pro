@@ -8,8 +8,32 @@ include(../default.pri)
 
 SOURCES += \
 	mg_functions.cpp \
-    meshgenerator.cpp
+    meshgenerator.cpp \
+    imagereader.cpp \
+    tiledmeshgenerator.cpp \
+    parallelfor.cpp \
+    andersonmixing.cpp \
+    snapshotstream.cpp \
+    generatortree.cpp \
+    remeshgenerator.cpp \
+    polygon.cpp \
+    poissondisk.cpp \
+    numa.cpp \
+    labelraster.cpp \
+    outputwriter.cpp
 
 HEADERS +=\
 	mg_functions.h \
-    meshgenerator.h
+    meshgenerator.h \
+    imagereader.h \
+    tiledmeshgenerator.h \
+    parallelfor.h \
+    andersonmixing.h \
+    snapshotstream.h \
+    generatortree.h \
+    remeshgenerator.h \
+    polygon.h \
+    poissondisk.h \
+    numa.h \
+    labelraster.h \
+    outputwriter.h
@@ -0,0 +1,288 @@
+#include "tiledmeshgenerator.h"
+
+#include <iomanip>
+
+//------------------------------------------------------------------------------
+mg::TiledMeshGenerator::TiledMeshGenerator(mg::Parameters parameters):
+    param(parameters),
+    reader(parameters.imgPath, parameters.cacheMask)
+{
+    w = reader.width();
+    h = reader.height();
+    tileSize = parameters.tileSize;
+    halo = parameters.tileHalo;
+    ntx = (w + tileSize - 1)/tileSize;
+    nty = (h + tileSize - 1)/tileSize;
+
+    // The domain spans [0, 1] in x, as for MeshGenerator without boundaries
+    pix = 1.0/w;
+
+    if(param.periodic_x || param.periodic_y)
+        std::cerr << "Periodic boundaries are ignored in tiled mode"
+                  << std::endl;
+}
+//------------------------------------------------------------------------------
+int mg::TiledMeshGenerator::createMesh(string base)
+{
+    reader.createCache();
+    countPorePixels();
+
+    string fileName = base + ".xyz";
+    ofstream outStream(fileName.c_str());
+
+    // The number of particles is only known at the end, so the first line is
+    // padded and overwritten when all tiles are written.
+    outStream << std::setw(20) << std::left << 0 << endl;
+    outStream << "# id x y z volume" << endl;
+
+    for(int ty=0; ty<nty; ty++)
+    {
+        for(int tx=0; tx<ntx; tx++)
+        {
+            std::cout << "Tile " << tx + ntx*ty + 1 << " of " << ntx*nty
+                      << std::endl;
+            processTile(tx, ty, outStream);
+        }
+    }
+
+    // Every generator is settled by the last tile with pore space around it
+    for(FrozenGenerator &g:frozen)
+        if(!g.written)
+            writeGenerator(g, outStream);
+
+    outStream.seekp(0);
+    outStream << std::setw(20) << std::left << nWritten;
+    outStream.close();
+    cout << fileName << endl;
+
+    return nWritten;
+}
+//------------------------------------------------------------------------------
+void mg::TiledMeshGenerator::writeConfiguration()
+{
+    std::cout << "Writing configuration" << std::endl;
+    string fileName = param.basePath + "/configuration.cfg";
+    mg::writeConfiguration(fileName, nWritten, optimalGridSpacing,
+                           0, w*pix, 0, h*pix, false, false);
+}
+//------------------------------------------------------------------------------
+void mg::TiledMeshGenerator::countPorePixels()
+{
+    // Streaming the image one row at a time
+    porePixels = std::vector<long>(ntx*nty, 0);
+    long totalPore = 0;
+
+    for(int i=0; i<h; i++)
+    {
+        arma::uchar_mat row = reader.readRegion(0, i, w, 1);
+        int ty = i/tileSize;
+        for(int j=0; j<w; j++)
+        {
+            if(row(0, j) > 0)
+                continue;
+            porePixels[j/tileSize + ntx*ty]++;
+            totalPore++;
+        }
+    }
+
+    if(totalPore == 0)
+    {
+        std::cerr << "The image contains no pore space" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    particlesPerPixel = double(param.nParticles)/totalPore;
+}
+//------------------------------------------------------------------------------
+int mg::TiledMeshGenerator::settleTile(double gx, double gy) const
+{
+    // The cell of a generator is assumed to lie within half a halo of it, so
+    // it is final once the last tile with pore space within that distance
+    // is done. The generator is then inside the halo of that tile.
+    double reach = 0.5*halo;
+    int tx0 = std::max(0, int((gx/pix - reach)/tileSize));
+    int tx1 = std::min(ntx - 1, int((gx/pix + reach)/tileSize));
+    int ty0 = std::max(0, int((gy/pix - reach)/tileSize));
+    int ty1 = std::min(nty - 1, int((gy/pix + reach)/tileSize));
+
+    int last = -1;
+    for(int ty=ty0; ty<=ty1; ty++)
+        for(int tx=tx0; tx<=tx1; tx++)
+            if(porePixels[tx + ntx*ty] > 0)
+                last = std::max(last, tx + ntx*ty);
+    return last;
+}
+//------------------------------------------------------------------------------
+void mg::TiledMeshGenerator::writeGenerator(FrozenGenerator &g,
+                                            ofstream &outStream)
+{
+    outStream << nWritten << "\t" << g.r[0] << "\t" << g.r[1] << "\t"<< " 0 "
+              << " " << g.volume << std::endl;
+    nWritten++;
+    g.written = true;
+}
+//------------------------------------------------------------------------------
+void mg::TiledMeshGenerator::processTile(int tx, int ty, ofstream &outStream)
+{
+    // Tile core and the extended region including the halo, in pixels
+    int x0 = tx*tileSize;
+    int y0 = ty*tileSize;
+    int tw = std::min(tileSize, w - x0);
+    int th = std::min(tileSize, h - y0);
+
+    int ex0 = std::max(0, x0 - halo);
+    int ey0 = std::max(0, y0 - halo);
+    int ex1 = std::min(w, x0 + tw + halo);
+    int ey1 = std::min(h, y0 + th + halo);
+    int ew = ex1 - ex0;
+    int eh = ey1 - ey0;
+
+    if(porePixels[tx + ntx*ty] == 0)
+    {
+        pruneFrozen(x0, y0, tw, th);
+        return;
+    }
+
+    arma::uchar_mat region = reader.readRegion(ex0, ey0, ew, eh);
+
+    // Pixels in tiles already written are covered by the frozen generators.
+    auto processed = [&](int i, int j) {
+        int gy = ey0 + i;
+        int gx = ex0 + j;
+        return gy < y0 || (gy < y0 + th && gx < x0);
+    };
+
+    std::vector<int> freePore;
+    for(int j=0; j<ew; j++)
+        for(int i=0; i<eh; i++)
+            if(region(i, j) == 0 && !processed(i, j))
+                freePore.push_back(i + eh*j);
+
+    int tile = tx + ntx*ty;
+    int nFree = round(particlesPerPixel*freePore.size());
+    bool settles = false;
+    for(const FrozenGenerator &g:frozen)
+        if(!g.written && g.settleTile == tile)
+            settles = true;
+    if(nFree == 0 && !settles)
+    {
+        pruneFrozen(x0, y0, tw, th);
+        return;
+    }
+
+    // Random initial positions in the free pore space
+    std::default_random_engine generator(
+                std::chrono::system_clock::now().time_since_epoch().count());
+    std::uniform_real_distribution<double> distribution_offset(0, 1);
+
+    arma::mat x_free(2, nFree);
+    if(nFree > 0)
+    {
+        std::uniform_int_distribution<int>
+                distribution_pixel(0, freePore.size() - 1);
+        for(int k=0; k<nFree; k++)
+        {
+            int p = freePore[distribution_pixel(generator)];
+            x_free(0, k) = (p/eh + distribution_offset(generator))*pix;
+            x_free(1, k) = (p%eh + distribution_offset(generator))*pix;
+        }
+    }
+    std::vector<int>().swap(freePore);
+
+    // Frozen generators inside the extended region, in local coordinates
+    std::vector<int> fixedInRegion;
+    for(int f=0; f<(int)frozen.size(); f++)
+    {
+        double lx = frozen[f].r[0] - ex0*pix;
+        double ly = frozen[f].r[1] - ey0*pix;
+        if(lx >= 0 && lx < ew*pix && ly >= 0 && ly < eh*pix)
+            fixedInRegion.push_back(f);
+    }
+    arma::mat x_fixed(2, fixedInRegion.size());
+    for(int k=0; k<(int)fixedInRegion.size(); k++)
+    {
+        x_fixed(0, k) = frozen[fixedInRegion[k]].r[0] - ex0*pix;
+        x_fixed(1, k) = frozen[fixedInRegion[k]].r[1] - ey0*pix;
+    }
+
+    // Generating the mesh for the extended region
+    Parameters tileParam = param;
+    tileParam.setBoundaries = true;
+    tileParam.X_0 = 0;
+    tileParam.X_1 = ew*pix;
+    tileParam.Y_0 = 0;
+    tileParam.Y_1 = eh*pix;
+    tileParam.nParticles = nFree + x_fixed.n_cols;
+    // The frozen halo generators take samples as well, so the samples per
+    // generator of the full run are kept over all generators of the tile
+    double samplesPerGenerator = double(param.q)/param.nParticles;
+    tileParam.q = round(tileParam.nParticles*samplesPerGenerator);
+    tileParam.periodic_x = false;
+    tileParam.periodic_y = false;
+    tileParam.testingSave = false;
+    tileParam.saveImage = false;
+    // The volumes are computed with one raster pixel per image pixel
+    tileParam.imageResolution = w;
+
+    MeshGenerator tileGenerator(tileParam, region);
+    region.reset();
+    tileGenerator.setGenerators(x_free, x_fixed);
+    arma::mat x = x_free;
+    if(nFree > 0)
+        x = tileGenerator.createMesh();
+    else
+        tileGenerator.createDomainGrid();
+    arma::vec volumes = tileGenerator.calculateVolumes();
+
+    if(optimalGridSpacing == 0 && nFree > 0)
+        optimalGridSpacing = tileGenerator.calculateRadialDistribution();
+
+    // The cells of the frozen generators waiting for this tile are now final
+    for(int k=0; k<(int)fixedInRegion.size(); k++)
+    {
+        FrozenGenerator &g = frozen[fixedInRegion[k]];
+        if(g.written || g.settleTile != tile)
+            continue;
+        g.volume = volumes[nFree + k];
+        writeGenerator(g, outStream);
+    }
+
+    // Writing the generators that ended up in the tile core, those whose
+    // cells reach into later tiles are held back
+    for(int k=0; k<nFree; k++)
+    {
+        double gx = x(0, k) + ex0*pix;
+        double gy = x(1, k) + ey0*pix;
+        if(gx < x0*pix || gx >= (x0 + tw)*pix ||
+                gy < y0*pix || gy >= (y0 + th)*pix)
+            continue;
+
+        FrozenGenerator g = {{{gx, gy}}, volumes[k], settleTile(gx, gy),
+                             false};
+        if(g.settleTile <= tile)
+            writeGenerator(g, outStream);
+        frozen.push_back(g);
+    }
+
+    pruneFrozen(x0, y0, tw, th);
+}
+//------------------------------------------------------------------------------
+void mg::TiledMeshGenerator::pruneFrozen(int x0, int y0, int tw, int th)
+{
+    // Keeping only generators within the halo of the remaining tiles: the
+    // rest of this tile row and the following tile rows, and those not yet
+    // written.
+    double nextRow = (y0 + th - halo)*pix;
+    double thisRow = (y0 - halo)*pix;
+    double nextTile = (x0 + tw - halo)*pix;
+
+    std::vector<FrozenGenerator> kept;
+    for(const FrozenGenerator &g:frozen)
+    {
+        const std::array<double, 2> &r = g.r;
+        if(!g.written || r[1] >= nextRow ||
+                (r[1] >= thisRow && r[0] >= nextTile))
+            kept.push_back(g);
+    }
+    frozen.swap(kept);
+}
+//------------------------------------------------------------------------------
@@ -0,0 +1,76 @@
+/**
+ * @file
+ *
+ * @section DESCRIPTION
+ *
+ * The TiledMeshGenerator class generates a mesh from images larger than the
+ * available memory. The image is processed tile by tile, each tile extended
+ * by a halo. Generators already written by previous tiles are kept fixed in
+ * the halo, so that the tiles join without visible seams. Positions and
+ * volumes are streamed to disk as each tile is completed, except for the
+ * generators next to a later tile, which are written with that tile.
+ */
+
+#ifndef TILEDMESHGENERATOR_H
+#define TILEDMESHGENERATOR_H
+
+#include <armadillo>
+#include <fstream>
+#include <vector>
+#include <array>
+
+#include "meshgenerator.h"
+#include "imagereader.h"
+
+//------------------------------------------------------------------------------
+// NAMESPACE MG
+//------------------------------------------------------------------------------
+namespace mg
+{
+//------------------------------------------------------------------------------
+class TiledMeshGenerator
+{
+public:
+    TiledMeshGenerator(Parameters parameters);
+    int createMesh(string base);
+    void writeConfiguration();
+protected:
+    Parameters param;
+    ImageReader reader;
+
+    int w;
+    int h;
+    int tileSize;
+    int halo;
+    int ntx;
+    int nty;
+    double pix;
+
+    // Number of pore pixels in each tile core
+    std::vector<long> porePixels;
+    double particlesPerPixel;
+
+    // Generators of finished tiles that may still lie in the halo of a tile
+    // not yet processed. Generators near a later tile are only written when
+    // that tile is done, since their cells depend on its generators.
+    struct FrozenGenerator
+    {
+        std::array<double, 2> r;
+        double volume;
+        int settleTile;
+        bool written;
+    };
+    std::vector<FrozenGenerator> frozen;
+
+    int nWritten = 0;
+    double optimalGridSpacing = 0;
+
+    void countPorePixels();
+    int settleTile(double gx, double gy) const;
+    void writeGenerator(FrozenGenerator &g, ofstream &outStream);
+    void processTile(int tx, int ty, ofstream &outStream);
+    void pruneFrozen(int x0, int y0, int tw, int th);
+};
+//------------------------------------------------------------------------------
+}
+#endif // TILEDMESHGENERATOR_H